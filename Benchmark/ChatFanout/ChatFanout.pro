@@ -0,0 +1,18 @@
+# チャットのファンアウト (uWS のトピックによる配信) のベンチマーク
+# 1 本のソケットから送ったチャットが、同じルームの N 本のソケットに届くまでの時間を測る
+QT       = core websockets
+CONFIG  += console c++17
+CONFIG  -= app_bundle
+
+CONFIG( release, debug|release ) {
+    unix {
+        QMAKE_CXXFLAGS_RELEASE -= -O2
+        QMAKE_CXXFLAGS_RELEASE += -O3
+    }
+}
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    ../Common/Statistics.h
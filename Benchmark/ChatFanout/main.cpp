@@ -0,0 +1,143 @@
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <QWebSocket>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../Common/Statistics.h"
+
+// 使い方: ChatFanout [url] [subscribers] [messages] [interval_ms]
+//
+// subscribers 本のソケットで同じルームに join し、先頭のソケットから messages 件のチャットを送る
+// 各チャットには送信時刻 (同一プロセス内の単調時計) を入れておき、全ソケットで受信までの時間を集計して JSON で出力する
+// (接続数が多い場合は ulimit -n を増やしておくこと)
+namespace
+{
+
+const char* const Room = "fanout-benchmark";
+
+} // end of namespace
+
+int main( int argc, char* argv[] )
+{
+    QCoreApplication app( argc, argv );
+    const QUrl url( argc > 1 ? QString::fromLocal8Bit( argv[1] ) : QString::fromUtf8( "ws://localhost:60000" ) );
+    const int numberOfSubscribers = argc > 2 ? std::max( 1, std::atoi( argv[2] ) ) : 1000;
+    const int numberOfMessages = argc > 3 ? std::max( 1, std::atoi( argv[3] ) ) : 100;
+    const int interval = argc > 4 ? std::max( 0, std::atoi( argv[4] ) ) : 10;
+
+    QElapsedTimer clock;
+    clock.start();
+
+    std::vector<QWebSocket*> sockets;
+    std::vector<double> latencies; // usec
+    latencies.reserve( static_cast<std::size_t>( numberOfSubscribers ) * numberOfMessages );
+    int joined = 0;
+    int failed = 0;
+    int sent = 0;
+    qint64 firstSend = 0;
+    qint64 lastReceive = 0;
+
+    QTimer sender;
+    sender.setInterval( interval );
+
+    bool finished = false;
+    auto expected = [&]() { return static_cast<std::size_t>( numberOfSubscribers - failed ) * numberOfMessages; };
+    auto finish = [&]()
+    {
+        if( finished ) return;
+        finished = true;
+        const double seconds = std::max<qint64>( lastReceive - firstSend, 1 ) / 1e9;
+        const std::size_t delivered = latencies.size();
+        const Statistics::Summary latency = Statistics::Summarize( latencies );
+        std::printf( "{\"subscribers\":%d,\"messages\":%d,\"connect_failures\":%d,\"delivered\":%zu,\"expected\":%zu,"
+                     "\"deliveries_per_sec\":%.1f,\"latency_us\":{\"p50\":%.1f,\"p95\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+                     numberOfSubscribers, numberOfMessages, failed, delivered, expected(),
+                     delivered / seconds,
+                     latency.p50, latency.p95, latency.p99, latency.max );
+        for( QWebSocket* socket : sockets ) socket->close();
+        app.quit();
+    };
+
+    // 最後の送信から一定時間届かなければ、届いた分だけで集計する
+    QTimer timeout;
+    timeout.setSingleShot( true );
+    timeout.setInterval( 10000 );
+    QObject::connect( &timeout, &QTimer::timeout, finish );
+
+    // 接続できた全ソケットが join したら送信を始める
+    auto startIfReady = [&]()
+    {
+        if( joined + failed < numberOfSubscribers || sender.isActive() ) return;
+        if( joined == 0 ) { finish(); return; }
+        sender.start();
+    };
+
+    QObject::connect( &sender, &QTimer::timeout, [&]()
+    {
+        if( sent == numberOfMessages )
+        {
+            sender.stop();
+            return;
+        }
+
+        const qint64 now = clock.nsecsElapsed();
+        if( sent == 0 ) firstSend = now;
+        QJsonObject message;
+        message["type"] = QString::fromUtf8( "chat" );
+        message["chat_message"] = QString::number( now );
+        sockets.front()->sendTextMessage( QString::fromUtf8( QJsonDocument( message ).toJson( QJsonDocument::Compact ) ) );
+        ++sent;
+        timeout.start();
+    } );
+
+    for( int i = 0; i < numberOfSubscribers; ++i )
+    {
+        auto* socket = new QWebSocket( QString(), QWebSocketProtocol::VersionLatest, &app );
+        sockets.push_back( socket );
+
+        QObject::connect( socket, &QWebSocket::connected, [socket]()
+        {
+            QJsonObject join;
+            join["type"] = QString::fromUtf8( "join" );
+            join["room"] = QString::fromUtf8( Room );
+            socket->sendTextMessage( QString::fromUtf8( QJsonDocument( join ).toJson( QJsonDocument::Compact ) ) );
+        } );
+
+        QObject::connect( socket, QOverload<QAbstractSocket::SocketError>::of( &QWebSocket::error ), [&, socket]( QAbstractSocket::SocketError )
+        {
+            if( socket->property( "joined" ).toBool() ) return;
+            if( ++failed == 1 ) std::fprintf( stderr, "connection failed: %s (ulimit -n?)\n", qPrintable( socket->errorString() ) );
+            startIfReady();
+        } );
+
+        QObject::connect( socket, &QWebSocket::textMessageReceived, [&, socket]( const QString& text )
+        {
+            const QJsonObject message = QJsonDocument::fromJson( text.toUtf8() ).object();
+            const QString type = message.value( "type" ).toString();
+            if( type == "join" )
+            {
+                socket->setProperty( "joined", true );
+                ++joined;
+                startIfReady();
+            }
+            else if( type == "chat" )
+            {
+                const qint64 now = clock.nsecsElapsed();
+                latencies.push_back( ( now - message.value( "chat_message" ).toString().toLongLong() ) / 1000.0 );
+                lastReceive = now;
+                if( latencies.size() == expected() ) finish();
+            }
+        } );
+
+        socket->open( url );
+    }
+
+    return app.exec();
+}
@@ -0,0 +1,52 @@
+#ifndef BENCHMARK_STATISTICS_H
+#define BENCHMARK_STATISTICS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+// ベンチマーク共通の集計
+namespace Statistics
+{
+
+struct Summary
+{
+    std::size_t count = 0;
+    double mean = 0.0;
+    double p50 = 0.0;
+    double p95 = 0.0;
+    double p99 = 0.0;
+    double max = 0.0;
+};
+
+// 最近傍順位法によるパーセンタイル (p は 0-1。values は並べ替えられる)
+// 小さい方から数えて ceil( p * n ) 番目 (1 始まり) の値。p = 0 は最小値になる
+inline double Percentile( std::vector<double>& values, const double p )
+{
+    if( values.empty() ) return 0.0;
+    const double rank = std::ceil( p * static_cast<double>( values.size() ) - 1e-9 ); // 0.07 * 100 = 7.000000000000001 などの丸め誤差を除く
+    const std::size_t index = rank < 1.0 ? 0 : std::min( values.size(), static_cast<std::size_t>( rank ) ) - 1;
+    std::nth_element( values.begin(), values.begin() + index, values.end() );
+    return values[ index ];
+}
+
+inline Summary Summarize( std::vector<double> values )
+{
+    Summary summary;
+    summary.count = values.size();
+    if( values.empty() ) return summary;
+
+    double sum = 0.0;
+    for( double value : values ) sum += value;
+    summary.mean = sum / values.size();
+    summary.p50 = Percentile( values, 0.50 );
+    summary.p95 = Percentile( values, 0.95 );
+    summary.p99 = Percentile( values, 0.99 );
+    summary.max = *std::max_element( values.begin(), values.end() );
+    return summary;
+}
+
+} // end of namespace Statistics
+
+#endif // BENCHMARK_STATISTICS_H
@@ -0,0 +1,20 @@
+# Server の WebSocket プロトコルに対する負荷生成ツール (GUI・GPU なし)
+QT       = core websockets
+CONFIG  += console c++17
+CONFIG  -= app_bundle
+
+CONFIG( release, debug|release ) {
+    unix {
+        QMAKE_CXXFLAGS_RELEASE -= -O2
+        QMAKE_CXXFLAGS_RELEASE += -O3
+    }
+}
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    ../../Shared/CoordinateQuantization.h \
+    ../../Shared/OctahedralNormal.h \
+    ../../Shared/ParticleWireFormat.h \
+    ../Common/Statistics.h
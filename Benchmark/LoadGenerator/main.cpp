@@ -0,0 +1,386 @@
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTimer>
+#include <QWebSocket>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "../../Shared/ParticleWireFormat.h"
+#include "../Common/Statistics.h"
+
+// Server の WebSocket プロトコルに対する負荷生成ツール (GUI・GPU なし)
+//
+// connections 本の接続から、"request" と "chat" をそれぞれ指定したレートで送り、
+// 粒子メッセージを展開して、スループットとレイテンシのパーセンタイルを JSON または CSV で出力する
+//
+// サーバは同じ接続の新しい要求で古い要求を取り消すので、要求は接続ごとに 1 つずつ送る
+// 要求は一定間隔の予定時刻に送り、前の応答が遅れて送れなかった分は応答が来た直後に送る
+// レイテンシは予定時刻から測る (応答の遅れで送信が間引かれても、その待ち時間を見落とさない)
+namespace
+{
+
+struct Options
+{
+    QUrl url;
+    int connections = 10;
+    double request_rate = 1.0;    // 接続ごとの要求数 / 秒 (0 で送らない)
+    double chat_rate = 0.0;       // 接続ごとのチャット数 / 秒 (0 で送らない)
+    double duration = 10.0;       // 秒
+    double grace = 5.0;           // 送信を止めてから応答を待つ秒数
+    bool csv = false;
+
+    // 要求の内容
+    int resolution = 32;
+    int repeat = 4;
+    double step = 0.5;
+    bool stream = false;
+    int coord_bits = 0;
+    QString normal_encoding = QString::fromUtf8( "float" );
+    bool unique_seeds = false;    // 要求ごとにシードを変えて、キャッシュと計算の共有を効かなくする
+};
+
+struct Results
+{
+    std::size_t requests_sent = 0;
+    std::size_t requests_completed = 0;
+    std::size_t server_errors = 0;
+    std::size_t invalid_messages = 0;
+    std::size_t messages_received = 0;
+    std::size_t bytes_received = 0;
+    std::size_t particles_received = 0;
+    std::size_t chats_sent = 0;
+    std::size_t connect_failures = 0;
+    std::vector<double> request_latencies;     // 予定時刻から応答が揃うまで (msec)
+    std::vector<double> first_chunk_latencies; // 予定時刻から最初の粒子メッセージまで (msec)
+    std::vector<double> chat_latencies;        // チャットを送ってから自分に届くまで (msec)
+};
+
+// 送信を止めた時点の累計 (スループットは測定区間の値で求め、猶予時間中に届いた応答は含めない)
+struct Throughput
+{
+    double elapsed = 0.0; // 測定開始から送信を止めるまでの秒数
+    std::size_t requests_completed = 0;
+    std::size_t bytes_received = 0;
+    std::size_t particles_received = 0;
+};
+
+class Connection
+{
+public:
+    Connection( const int index, const Options& options, Results& results, const QElapsedTimer& clock )
+        : m_index( index )
+        , m_options( options )
+        , m_results( results )
+        , m_clock( clock )
+        , m_seed( static_cast<std::uint64_t>( index ) << 32 )
+    {
+        m_request_timer.setSingleShot( true );
+        QObject::connect( &m_request_timer, &QTimer::timeout, &m_socket, [this]() { this->sendRequest(); } );
+        QObject::connect( &m_chat_timer, &QTimer::timeout, &m_socket, [this]() { this->sendChat(); } );
+
+        QObject::connect( &m_socket, &QWebSocket::connected, &m_socket, [this]()
+        {
+            // 自分のチャットが自分にも届くよう、専用のルームに入る
+            this->sendJson( { { "type", "join" }, { "room", "load-generator" } } );
+            m_connected = true;
+        } );
+        QObject::connect( &m_socket, QOverload<QAbstractSocket::SocketError>::of( &QWebSocket::error ), &m_socket, [this]( QAbstractSocket::SocketError )
+        {
+            if( !m_connected ) ++m_results.connect_failures;
+        } );
+        QObject::connect( &m_socket, &QWebSocket::binaryMessageReceived, &m_socket, [this]( const QByteArray& message ) { this->receiveParticles( message ); } );
+        QObject::connect( &m_socket, &QWebSocket::textMessageReceived, &m_socket, [this]( const QString& message ) { this->receiveText( message ); } );
+    }
+
+    void open() { m_socket.open( m_options.url ); }
+    bool isConnected() const { return m_connected; }
+    bool isWaiting() const { return m_outstanding; }
+
+    void start()
+    {
+        m_running = true;
+        m_next_request_time = m_clock.nsecsElapsed();
+        if( m_options.request_rate > 0.0 ) this->scheduleRequest();
+        if( m_options.chat_rate > 0.0 ) m_chat_timer.start( std::max( 1, static_cast<int>( 1000.0 / m_options.chat_rate ) ) );
+    }
+
+    void stop()
+    {
+        m_running = false;
+        m_request_timer.stop();
+        m_chat_timer.stop();
+    }
+
+    void close() { m_socket.close(); }
+
+private:
+    void sendJson( const QJsonObject& message )
+    {
+        m_socket.sendTextMessage( QString::fromUtf8( QJsonDocument( message ).toJson( QJsonDocument::Compact ) ) );
+    }
+
+    void scheduleRequest()
+    {
+        if( !m_running || m_outstanding ) return;
+        const qint64 wait = std::max<qint64>( 0, m_next_request_time - m_clock.nsecsElapsed() );
+        m_request_timer.start( static_cast<int>( wait / 1000000 ) );
+    }
+
+    void sendRequest()
+    {
+        if( !m_running || m_outstanding ) return;
+
+        QJsonObject message;
+        message["type"] = QString::fromUtf8( "request" );
+        message["resolution"] = m_options.resolution;
+        message["repeat"] = m_options.repeat;
+        message["step"] = m_options.step;
+        message["stream"] = m_options.stream;
+        message["coord_bits"] = m_options.coord_bits;
+        message["normal_encoding"] = m_options.normal_encoding;
+        message["seed"] = static_cast<double>( m_options.unique_seeds ? m_seed++ : 0 );
+        this->sendJson( message );
+
+        m_outstanding = true;
+        m_first_received = false;
+        m_scheduled_time = m_next_request_time;
+        m_next_request_time += static_cast<qint64>( 1e9 / m_options.request_rate );
+        ++m_results.requests_sent;
+    }
+
+    void sendChat()
+    {
+        if( !m_connected ) return;
+        const QString text = QString::fromUtf8( "lg %1 %2" ).arg( m_index ).arg( m_clock.nsecsElapsed() );
+        this->sendJson( { { "type", "chat" }, { "chat_message", text } } );
+        ++m_results.chats_sent;
+    }
+
+    void receiveParticles( const QByteArray& message )
+    {
+        const qint64 now = m_clock.nsecsElapsed();
+        ++m_results.messages_received;
+        m_results.bytes_received += static_cast<std::size_t>( message.size() );
+
+        ParticleWireFormat::Header header;
+        if( !ParticleWireFormat::ReadHeader( message.constData(), static_cast<std::size_t>( message.size() ), &header ) )
+        {
+            ++m_results.invalid_messages;
+            return;
+        }
+
+        // クライアントと同じように float / uint8 の配列に展開する (バッファは使い回す)
+        const std::size_t n = static_cast<std::size_t>( header.number_of_vertices );
+        m_coords.resize( n * 3 );
+        m_colors.resize( n * 3 );
+        m_normals.resize( n * 3 );
+        ParticleWireFormat::ReadParticles( header, message.constData(), m_coords.data(), m_colors.data(), m_normals.data() );
+        m_results.particles_received += n;
+
+        if( !m_outstanding ) return;
+        if( !m_first_received )
+        {
+            m_first_received = true;
+            m_results.first_chunk_latencies.push_back( ( now - m_scheduled_time ) / 1e6 );
+        }
+        if( !header.isChunk() || header.isLastChunk() )
+        {
+            m_outstanding = false;
+            ++m_results.requests_completed;
+            m_results.request_latencies.push_back( ( now - m_scheduled_time ) / 1e6 );
+            this->scheduleRequest();
+        }
+    }
+
+    void receiveText( const QString& text )
+    {
+        const qint64 now = m_clock.nsecsElapsed();
+        const QJsonObject message = QJsonDocument::fromJson( text.toUtf8() ).object();
+        const QString type = message.value( "type" ).toString();
+        if( type == "chat" )
+        {
+            // 自分が送ったチャットだけを測る ("lg <index> <送信時刻>")
+            const QStringList fields = message.value( "chat_message" ).toString().split( ' ' );
+            if( fields.size() == 3 && fields[0] == "lg" && fields[1].toInt() == m_index )
+            {
+                m_results.chat_latencies.push_back( ( now - fields[2].toLongLong() ) / 1e6 );
+            }
+        }
+        else if( type == "error" )
+        {
+            ++m_results.server_errors;
+            if( m_outstanding )
+            {
+                m_outstanding = false; // 受け付けられなかった要求は待たない
+                this->scheduleRequest();
+            }
+        }
+    }
+
+    const int m_index;
+    const Options& m_options;
+    Results& m_results;
+    const QElapsedTimer& m_clock;
+    QWebSocket m_socket;
+    QTimer m_request_timer;
+    QTimer m_chat_timer;
+    bool m_connected = false;
+    bool m_running = false;
+    bool m_outstanding = false;
+    bool m_first_received = false;
+    qint64 m_next_request_time = 0;
+    qint64 m_scheduled_time = 0;
+    std::uint64_t m_seed;
+    std::vector<float> m_coords;
+    std::vector<std::uint8_t> m_colors;
+    std::vector<float> m_normals;
+};
+
+void PrintJson( const Options& options, const Results& results, const Throughput& throughput )
+{
+    auto summary = []( const std::vector<double>& values )
+    {
+        const Statistics::Summary s = Statistics::Summarize( values );
+        return QJsonObject{ { "count", static_cast<double>( s.count ) }, { "mean", s.mean }, { "p50", s.p50 }, { "p95", s.p95 }, { "p99", s.p99 }, { "max", s.max } };
+    };
+
+    QJsonObject report;
+    report["connections"] = options.connections;
+    report["connect_failures"] = static_cast<double>( results.connect_failures );
+    report["elapsed_sec"] = throughput.elapsed;
+    report["requests_sent"] = static_cast<double>( results.requests_sent );
+    report["requests_completed"] = static_cast<double>( results.requests_completed );
+    report["requests_per_sec"] = throughput.requests_completed / throughput.elapsed;
+    report["server_errors"] = static_cast<double>( results.server_errors );
+    report["invalid_messages"] = static_cast<double>( results.invalid_messages );
+    report["messages_received"] = static_cast<double>( results.messages_received );
+    report["megabytes_per_sec"] = throughput.bytes_received / throughput.elapsed / 1e6;
+    report["particles_per_sec"] = throughput.particles_received / throughput.elapsed;
+    report["chats_sent"] = static_cast<double>( results.chats_sent );
+    report["request_latency_ms"] = summary( results.request_latencies );
+    report["first_chunk_latency_ms"] = summary( results.first_chunk_latencies );
+    report["chat_latency_ms"] = summary( results.chat_latencies );
+    std::printf( "%s\n", QJsonDocument( report ).toJson( QJsonDocument::Indented ).constData() );
+}
+
+void PrintCsv( const Options& options, const Results& results, const Throughput& throughput )
+{
+    const Statistics::Summary request = Statistics::Summarize( results.request_latencies );
+    const Statistics::Summary first = Statistics::Summarize( results.first_chunk_latencies );
+    const Statistics::Summary chat = Statistics::Summarize( results.chat_latencies );
+    std::printf( "connections,elapsed_sec,requests_sent,requests_completed,requests_per_sec,server_errors,megabytes_per_sec,particles_per_sec,"
+                 "request_p50_ms,request_p95_ms,request_p99_ms,first_chunk_p50_ms,first_chunk_p95_ms,first_chunk_p99_ms,"
+                 "chats_sent,chats_received,chat_p50_ms,chat_p95_ms,chat_p99_ms\n" );
+    std::printf( "%d,%.3f,%zu,%zu,%.3f,%zu,%.3f,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%zu,%zu,%.3f,%.3f,%.3f\n",
+                 options.connections, throughput.elapsed, results.requests_sent, results.requests_completed, throughput.requests_completed / throughput.elapsed,
+                 results.server_errors, throughput.bytes_received / throughput.elapsed / 1e6, throughput.particles_received / throughput.elapsed,
+                 request.p50, request.p95, request.p99, first.p50, first.p95, first.p99,
+                 results.chats_sent, chat.count, chat.p50, chat.p95, chat.p99 );
+}
+
+} // end of namespace
+
+int main( int argc, char* argv[] )
+{
+    QCoreApplication app( argc, argv );
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription( "Load generator for the particle server" );
+    parser.addHelpOption();
+    parser.addOptions( {
+        { "url", "Server URL.", "url", "ws://localhost:60000" },
+        { "connections", "Number of connections.", "n", "10" },
+        { "request-rate", "Requests per second per connection (0: none).", "rate", "1" },
+        { "chat-rate", "Chat messages per second per connection (0: none).", "rate", "0" },
+        { "duration", "Measurement duration in seconds.", "sec", "10" },
+        { "grace", "Seconds to wait for outstanding responses.", "sec", "5" },
+        { "format", "Output format (json or csv).", "format", "json" },
+        { "resolution", "Volume resolution.", "n", "32" },
+        { "repeat", "Repetition level.", "n", "4" },
+        { "step", "Sampling step.", "step", "0.5" },
+        { "stream", "Request progressive chunks." },
+        { "coord-bits", "Coordinate quantization bits (0: float32).", "bits", "0" },
+        { "normal-encoding", "float, oct8 or oct16.", "encoding", "float" },
+        { "unique-seeds", "Use a new seed for every request (bypasses the result cache)." },
+    } );
+    parser.process( app );
+
+    Options options;
+    options.url = QUrl( parser.value( "url" ) );
+    options.connections = std::max( 1, parser.value( "connections" ).toInt() );
+    options.request_rate = std::max( 0.0, parser.value( "request-rate" ).toDouble() );
+    options.chat_rate = std::max( 0.0, parser.value( "chat-rate" ).toDouble() );
+    options.duration = std::max( 0.1, parser.value( "duration" ).toDouble() );
+    options.grace = std::max( 0.0, parser.value( "grace" ).toDouble() );
+    options.csv = parser.value( "format" ) == "csv";
+    options.resolution = parser.value( "resolution" ).toInt();
+    options.repeat = parser.value( "repeat" ).toInt();
+    options.step = parser.value( "step" ).toDouble();
+    options.stream = parser.isSet( "stream" );
+    options.coord_bits = parser.value( "coord-bits" ).toInt();
+    options.normal_encoding = parser.value( "normal-encoding" );
+    options.unique_seeds = parser.isSet( "unique-seeds" );
+
+    QElapsedTimer clock;
+    clock.start();
+
+    Results results;
+    std::vector<std::unique_ptr<Connection>> connections;
+    for( int i = 0; i < options.connections; ++i )
+    {
+        connections.push_back( std::make_unique<Connection>( i, options, results, clock ) );
+        connections.back()->open();
+    }
+
+    qint64 startTime = 0;
+    qint64 stopTime = 0;
+    Throughput throughput;
+    auto finish = [&]()
+    {
+        if( options.csv ) PrintCsv( options, results, throughput );
+        else PrintJson( options, results, throughput );
+        for( auto& connection : connections ) connection->close();
+        app.quit();
+    };
+
+    // 接続が揃う (または失敗する) のを待ってから測定を始め、duration 経過後に送信を止めて応答を待つ
+    QTimer poll;
+    QObject::connect( &poll, &QTimer::timeout, [&]()
+    {
+        const qint64 now = clock.nsecsElapsed();
+        if( startTime == 0 )
+        {
+            const auto connected = std::count_if( connections.begin(), connections.end(), []( const auto& c ) { return c->isConnected(); } );
+            if( connected + static_cast<long>( results.connect_failures ) < options.connections && now < 10e9 ) return;
+            startTime = now;
+            for( auto& connection : connections ) if( connection->isConnected() ) connection->start();
+            return;
+        }
+
+        if( stopTime == 0 && now - startTime >= options.duration * 1e9 )
+        {
+            stopTime = now;
+            for( auto& connection : connections ) connection->stop();
+            throughput.elapsed = std::max<qint64>( stopTime - startTime, 1 ) / 1e9;
+            throughput.requests_completed = results.requests_completed;
+            throughput.bytes_received = results.bytes_received;
+            throughput.particles_received = results.particles_received;
+        }
+
+        if( stopTime != 0 )
+        {
+            const bool waiting = std::any_of( connections.begin(), connections.end(), []( const auto& c ) { return c->isWaiting(); } );
+            if( !waiting || now - stopTime >= options.grace * 1e9 ) finish();
+        }
+    } );
+    poll.start( 10 );
+
+    return app.exec();
+}
@@ -0,0 +1,49 @@
+# サンプリングのベンチマーク
+# HydrogenVolumeData の解像度・repeat・step・スレッド数の組み合わせごとに
+# kvs::CellByCellMetropolisSampling と ParallelCellByCellSampling を実行し、粒子数 / 秒・ピーク RSS・並列化効率を CSV で出力する
+TEMPLATE = app
+CONFIG  += console c++20
+CONFIG  -= app_bundle qt
+
+CONFIG( release, debug|release ) {
+    win32 {
+        QMAKE_CXXFLAGS_RELEASE -= -O2
+        QMAKE_CXXFLAGS_RELEASE += /Ox
+    }
+    unix {
+        QMAKE_CXXFLAGS_RELEASE -= -O2
+        QMAKE_CXXFLAGS_RELEASE += -O3
+    }
+}
+
+KVS_DIR = $$(KVS_DIR)
+
+isEmpty( KVS_DIR ) {
+    error( "The environment variable KVS_DIR is not defined." )
+}
+else {
+    include( $$KVS_DIR/kvs.conf )
+    win32 {
+        DEFINES += WIN32 _MBCS NOMINMAX _SCL_SECURE_NO_DEPRECATE _CRT_SECURE_NO_DEPRECATE _CRT_NONSTDC_NO_DEPRECATE
+    }
+    DEFINES += NDEBUG
+    INCLUDEPATH += $$KVS_DIR/include
+    LIBS += -L$$KVS_DIR/lib -lkvsCore
+}
+
+win32 {
+    LIBS += -lpsapi
+}
+
+INCLUDEPATH += ../../Server
+
+SOURCES += \
+    ../../Server/ParallelCellByCellSampling.cpp \
+    ../../Server/WorkerPool.cpp \
+    main.cpp
+
+HEADERS += \
+    ../../Server/ParallelCellByCellSampling.h \
+    ../../Server/WorkerPool.h \
+    ../../Shared/Trace.h \
+    ../Common/Statistics.h
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined( _WIN32 )
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include <kvs/CellByCellMetropolisSampling>
+#include <kvs/HydrogenVolumeData>
+#include <kvs/PointObject>
+#include <kvs/TransferFunction>
+
+#include "ParallelCellByCellSampling.h"
+#include "WorkerPool.h"
+#include "../Common/Statistics.h"
+
+// サンプリングのベンチマーク
+//
+// HydrogenVolumeData の解像度 × repeat × step の組み合わせごとに
+//   kvs      : kvs::CellByCellMetropolisSampling (サーバが Uniform 以外のボリュームで使う経路)
+//   parallel : ParallelCellByCellSampling (スレッド数ごと)
+// を実行し、1 行 1 計測の CSV を出力する
+//
+//   particles_per_sec  : 粒子数 / 実行時間 (runs 回の中央値)
+//   peak_rss_mb        : 計測中のピーク RSS (Linux はサンプラごとに clear_refs でリセットする。
+//                        リセットできない環境ではプロセス開始からの最大値になる)
+//   efficiency         : parallel の (T スレッドの粒子数 / 秒) / (最小スレッド数の粒子数 / 秒 × T / 最小スレッド数)
+//   particles_vs_kvs   : kvs に対する粒子数の比 (2 つのサンプラは密度の式が異なるので、同じ条件でも粒子数は一致しない)
+//   speedup_vs_kvs     : kvs に対する粒子数 / 秒の比。粒子数が ±10% 以内で一致した場合だけ出力し、それ以外は空にする
+//                        (仕事量の異なる計測どうしを実行時間で比べないようにする)
+//
+// 使い方: Sampling [--resolutions 32,64,128] [--repeats 1,4,16] [--steps 0.5,1] [--threads 1,2,4,...]
+//                  [--samplers kvs,parallel] [--runs 3] [--seed 0]
+namespace
+{
+
+struct Options
+{
+    std::vector<unsigned int> resolutions = { 32, 64, 128 };
+    std::vector<unsigned int> repeats = { 1, 4, 16 };
+    std::vector<double> steps = { 0.5, 1.0 };
+    std::vector<unsigned int> threads;
+    bool kvs = true;
+    bool parallel = true;
+    unsigned int runs = 3;
+    std::uint64_t seed = 0;
+};
+
+template <typename T>
+std::vector<T> ParseList( const std::string& text )
+{
+    std::vector<T> values;
+    std::size_t begin = 0;
+    while( begin < text.size() )
+    {
+        const std::size_t end = std::min( text.find( ',', begin ), text.size() );
+        const double value = std::atof( text.substr( begin, end - begin ).c_str() );
+        if( value > 0.0 ) values.push_back( static_cast<T>( value ) );
+        begin = end + 1;
+    }
+    return values;
+}
+
+// 既定のスレッド数: 1, 2, 4, ... とハードウェアスレッド数
+std::vector<unsigned int> DefaultThreads()
+{
+    const unsigned int hardware = std::max( std::thread::hardware_concurrency(), 1u );
+    std::vector<unsigned int> threads;
+    for( unsigned int t = 1; t < hardware; t *= 2 ) threads.push_back( t );
+    threads.push_back( hardware );
+    return threads;
+}
+
+// ピーク RSS をリセットする (Linux 4.0 以降のみ。それ以外では何もしない)
+void ResetPeakRss()
+{
+#if defined( __linux__ )
+    std::ofstream clearRefs( "/proc/self/clear_refs" );
+    if( clearRefs ) clearRefs << "5";
+#endif
+}
+
+double PeakRssMegabytes()
+{
+#if defined( _WIN32 )
+    PROCESS_MEMORY_COUNTERS counters;
+    if( !GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) ) return 0.0;
+    return counters.PeakWorkingSetSize / 1048576.0;
+#else
+#if defined( __linux__ )
+    // clear_refs でリセットされる値は /proc/self/status の VmHWM に現れる
+    std::ifstream status( "/proc/self/status" );
+    std::string line;
+    while( std::getline( status, line ) )
+    {
+        if( line.compare( 0, 6, "VmHWM:" ) == 0 ) return std::atof( line.c_str() + 6 ) / 1024.0;
+    }
+#endif
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+#if defined( __APPLE__ )
+    return usage.ru_maxrss / 1048576.0; // バイト単位
+#else
+    return usage.ru_maxrss / 1024.0;    // KB 単位
+#endif
+#endif
+}
+
+struct Measurement
+{
+    std::size_t particles = 0;
+    double seconds = 0.0; // 中央値
+    double peak_rss_mb = 0.0;
+};
+
+// sampler() が返す粒子を runs 回生成して測る
+template <typename Sampler>
+Measurement Measure( Sampler&& sampler, const unsigned int runs )
+{
+    using Clock = std::chrono::steady_clock;
+
+    ResetPeakRss();
+    Measurement measurement;
+    std::vector<double> times;
+    for( unsigned int i = 0; i < runs; ++i )
+    {
+        const auto start = Clock::now();
+        std::unique_ptr<kvs::PointObject> object( sampler() );
+        times.push_back( std::chrono::duration<double>( Clock::now() - start ).count() );
+        measurement.particles = object->numberOfVertices();
+    }
+    measurement.seconds = Statistics::Summarize( times ).p50;
+    measurement.peak_rss_mb = PeakRssMegabytes();
+    return measurement;
+}
+
+void PrintRow(
+    const char* sampler,
+    const unsigned int resolution,
+    const unsigned int repeat,
+    const double step,
+    const unsigned int threads,
+    const Measurement& m,
+    const double efficiency,
+    const Measurement* kvs )
+{
+    // kvs の計測が無ければ比は空にする
+    char particleRatio[32] = "";
+    char speedup[32] = "";
+    const double rate = m.seconds > 0.0 ? m.particles / m.seconds : 0.0;
+    if( kvs && kvs->particles > 0 && kvs->seconds > 0.0 )
+    {
+        const double ratio = static_cast<double>( m.particles ) / static_cast<double>( kvs->particles );
+        std::snprintf( particleRatio, sizeof( particleRatio ), "%.3f", ratio );
+        if( 0.9 <= ratio && ratio <= 1.1 ) std::snprintf( speedup, sizeof( speedup ), "%.3f", rate / ( kvs->particles / kvs->seconds ) );
+    }
+    std::printf( "%s,%u,%u,%.3f,%u,%zu,%.4f,%.0f,%.1f,%.3f,%s,%s\n",
+                 sampler, resolution, repeat, step, threads, m.particles, m.seconds,
+                 rate, m.peak_rss_mb, efficiency, particleRatio, speedup );
+    std::fflush( stdout );
+}
+
+} // end of namespace
+
+int main( int argc, char* argv[] )
+{
+    Options options;
+    for( int i = 1; i < argc; ++i )
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if( arg == "--resolutions" && hasValue ) options.resolutions = ParseList<unsigned int>( argv[++i] );
+        else if( arg == "--repeats" && hasValue ) options.repeats = ParseList<unsigned int>( argv[++i] );
+        else if( arg == "--steps" && hasValue ) options.steps = ParseList<double>( argv[++i] );
+        else if( arg == "--threads" && hasValue ) options.threads = ParseList<unsigned int>( argv[++i] );
+        else if( arg == "--runs" && hasValue ) options.runs = std::max( 1, std::atoi( argv[++i] ) );
+        else if( arg == "--seed" && hasValue ) options.seed = std::strtoull( argv[++i], nullptr, 10 );
+        else if( arg == "--samplers" && hasValue )
+        {
+            const std::string samplers = argv[++i];
+            options.kvs = samplers.find( "kvs" ) != std::string::npos;
+            options.parallel = samplers.find( "parallel" ) != std::string::npos;
+        }
+        else
+        {
+            std::fprintf( stderr,
+                          "usage: %s [--resolutions n,...] [--repeats n,...] [--steps s,...] [--threads n,...]\n"
+                          "          [--samplers kvs,parallel] [--runs n] [--seed n]\n", argv[0] );
+            return 1;
+        }
+    }
+    if( options.threads.empty() ) options.threads = DefaultThreads();
+    std::sort( options.threads.begin(), options.threads.end() );
+
+    // サーバの既定と同じ伝達関数
+    const kvs::TransferFunction tfunc( 256 );
+
+    // threads は kvs では 0 (KVS のビルド設定に従う)
+    std::printf( "sampler,resolution,repeat,step,threads,particles,time_sec,particles_per_sec,peak_rss_mb,efficiency,particles_vs_kvs,speedup_vs_kvs\n" );
+    for( const unsigned int resolution : options.resolutions )
+    {
+        auto volume = std::make_unique<kvs::HydrogenVolumeData>( kvs::Vec3ui( resolution, resolution, resolution ) );
+        if( !volume->hasMinMaxValues() ) volume->updateMinMaxValues();
+
+        for( const unsigned int repeat : options.repeats )
+        {
+            for( const double step : options.steps )
+            {
+                Measurement kvsMeasurement;
+                if( options.kvs )
+                {
+                    kvsMeasurement = Measure( [&]()
+                    {
+                        return new kvs::CellByCellMetropolisSampling( volume.get(), repeat, static_cast<float>( step ), tfunc );
+                    }, options.runs );
+                    PrintRow( "kvs", resolution, repeat, step, 0, kvsMeasurement, 1.0, &kvsMeasurement );
+                }
+
+                if( options.parallel )
+                {
+                    double baseRate = 0.0;
+                    for( const unsigned int threads : options.threads )
+                    {
+                        // 呼び出し元スレッドと合わせて threads 本になるよう、補助スレッドのプールを計測の外で用意する
+                        WorkerPool pool( std::max( threads, 2u ) - 1 );
+                        const ParallelCellByCellSampling sampler( repeat, static_cast<float>( step ), tfunc, options.seed, threads, &pool );
+                        const Measurement m = Measure( [&]() { return sampler.exec( *volume ); }, options.runs );
+                        const double rate = m.seconds > 0.0 ? m.particles / m.seconds : 0.0;
+                        if( baseRate == 0.0 ) baseRate = rate / threads; // 最小スレッド数から 1 スレッドあたりを見積もる
+                        const double efficiency = baseRate > 0.0 ? rate / ( baseRate * threads ) : 0.0;
+                        PrintRow( "parallel", resolution, repeat, step, threads, m, efficiency, options.kvs ? &kvsMeasurement : nullptr );
+                    }
+                }
+            }
+        }
+    }
+
+    return 0;
+}
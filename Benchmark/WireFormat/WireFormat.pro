@@ -0,0 +1,21 @@
+# 粒子メッセージ (ParticleWireFormat) の符号化・復号のマイクロベンチマーク
+# Qt もネットワークも使わず、合成した粒子配列で各符号化の GB/s と確保回数を測る
+TEMPLATE = app
+CONFIG  += console c++17
+CONFIG  -= app_bundle qt
+
+CONFIG( release, debug|release ) {
+    unix {
+        QMAKE_CXXFLAGS_RELEASE -= -O2
+        QMAKE_CXXFLAGS_RELEASE += -O3
+    }
+}
+
+SOURCES += \
+    main.cpp
+
+HEADERS += \
+    ../../Shared/CoordinateQuantization.h \
+    ../../Shared/OctahedralNormal.h \
+    ../../Shared/ParticleWireFormat.h \
+    ../Common/Statistics.h
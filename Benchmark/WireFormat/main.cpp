@@ -0,0 +1,299 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../../Shared/ParticleWireFormat.h"
+#include "../Common/Statistics.h"
+
+// 粒子メッセージの符号化・復号のマイクロベンチマーク
+//
+//   encode      : Allocate + WriteParticles (サーバが 1 メッセージを組み立てる処理)
+//   decode      : ReadHeader + 量子化座標・圧縮法線だけの展開 (Client::decodeParticles と同じく、float32 のセクションと
+//                 色は受信バッファを参照し、コピーしない)
+//                 座標・法線とも float32 の場合はヘッダの検証だけになるので、GB/s は帯域ではなく 1 メッセージあたりの固定費を表す
+//   decode_copy : ReadHeader + 展開先の確保 + ReadParticles (全セクションを float / uint8 の配列に写す。LoadGenerator の処理)
+//
+// 粒子数と符号化 (座標のビット数 × 法線の符号化) の組み合わせごとに、1 回あたりの時間の中央値・
+// スループット (展開後の粒子データ 27 バイト / 粒子を基準にした GB/s と、メッセージのバイト数基準の GB/s)・
+// 1 回あたりのメモリ確保回数とバイト数を CSV で出力する
+//
+// 使い方: WireFormat [--sizes 10000,100000,...] [--min-time 秒] [--min-iterations 回数]
+namespace
+{
+
+// 計測区間内のメモリ確保を数えるため、グローバルの operator new を置き換える
+std::atomic<std::size_t> AllocationCount{ 0 };
+std::atomic<std::size_t> AllocationBytes{ 0 };
+
+struct AllocationSnapshot
+{
+    std::size_t count = AllocationCount.load( std::memory_order_relaxed );
+    std::size_t bytes = AllocationBytes.load( std::memory_order_relaxed );
+};
+
+struct Particles
+{
+    std::vector<float> coords;
+    std::vector<std::uint8_t> colors;
+    std::vector<float> normals;
+    float min_coord[3] = { -1.0f, -1.0f, -1.0f };
+    float max_coord[3] = { 1.0f, 1.0f, 1.0f };
+};
+
+// PointObject 相当の合成データ (座標は [-1, 1]^3, 法線は単位ベクトル)
+Particles Generate( const std::size_t n )
+{
+    Particles particles;
+    particles.coords.resize( n * 3 );
+    particles.colors.resize( n * 3 );
+    particles.normals.resize( n * 3 );
+
+    std::mt19937 engine( 12345 );
+    std::uniform_real_distribution<float> uniform( -1.0f, 1.0f );
+    for( std::size_t i = 0; i < n * 3; ++i ) particles.coords[i] = uniform( engine );
+    for( std::size_t i = 0; i < n * 3; ++i ) particles.colors[i] = static_cast<std::uint8_t>( engine() );
+    for( std::size_t i = 0; i < n; ++i )
+    {
+        float v[3] = { uniform( engine ), uniform( engine ), uniform( engine ) };
+        const float length = std::sqrt( v[0] * v[0] + v[1] * v[1] + v[2] * v[2] );
+        for( int j = 0; j < 3; ++j ) particles.normals[ 3 * i + j ] = length > 0.0f ? v[j] / length : ( j == 2 ? 1.0f : 0.0f );
+    }
+    return particles;
+}
+
+ParticleWireFormat::Header MakeHeader( const Particles& particles, const int coordBits, const int normalEncoding )
+{
+    ParticleWireFormat::Header header;
+    header.coord_bits = static_cast<std::uint8_t>( coordBits );
+    header.normal_encoding = static_cast<std::uint8_t>( normalEncoding );
+    header.number_of_vertices = particles.coords.size() / 3;
+    for( int i = 0; i < 3; ++i )
+    {
+        header.min_object_coord[i] = particles.min_coord[i];
+        header.max_object_coord[i] = particles.max_coord[i];
+    }
+    ParticleWireFormat::ComputeLayout( &header );
+    return header;
+}
+
+std::vector<char> Encode( const Particles& particles, const ParticleWireFormat::Header& header )
+{
+    std::vector<char> message = ParticleWireFormat::Allocate( header );
+    ParticleWireFormat::WriteParticles(
+        header, message.data(), 0, header.number_of_vertices,
+        particles.coords.data(), particles.colors.data(), particles.normals.data() );
+    return message;
+}
+
+bool Decode( const std::vector<char>& message, Particles* particles )
+{
+    ParticleWireFormat::Header header;
+    if( !ParticleWireFormat::ReadHeader( message.data(), message.size(), &header ) ) return false;
+
+    const std::size_t n = static_cast<std::size_t>( header.number_of_vertices );
+    particles->coords = std::vector<float>( n * 3 );
+    particles->colors = std::vector<std::uint8_t>( n * 3 );
+    particles->normals = std::vector<float>( n * 3 );
+    ParticleWireFormat::ReadParticles( header, message.data(), particles->coords.data(), particles->colors.data(), particles->normals.data() );
+    return true;
+}
+
+// クライアントと同じ展開の結果 (float32 のセクションと色はメッセージ内を指す)
+struct ParticleView
+{
+    const float* coords = nullptr;
+    const std::uint8_t* colors = nullptr;
+    const float* normals = nullptr;
+    std::vector<float> coord_storage;  // 量子化座標を展開した場合
+    std::vector<float> normal_storage; // 圧縮法線を展開した場合
+};
+
+// メッセージ内の float32 のセクションを参照する (Client の AdoptSection と同じく、境界が揃っていなければコピーする)
+const float* AdoptFloats( const char* data, const std::size_t size, std::vector<float>* storage )
+{
+    if( reinterpret_cast<std::uintptr_t>( data ) % alignof( float ) == 0 ) return reinterpret_cast<const float*>( data );
+    *storage = std::vector<float>( size );
+    std::memcpy( storage->data(), data, sizeof( float ) * size );
+    return storage->data();
+}
+
+bool DecodeInPlace( const std::vector<char>& message, ParticleView* view )
+{
+    ParticleWireFormat::Header header;
+    if( !ParticleWireFormat::ReadHeader( message.data(), message.size(), &header ) ) return false;
+
+    const std::size_t n = static_cast<std::size_t>( header.number_of_vertices );
+    const char* data = message.data();
+    if( header.coord_bits == 0 )
+    {
+        view->coords = AdoptFloats( data + header.coords.offset, n * 3, &view->coord_storage );
+    }
+    else
+    {
+        view->coord_storage = std::vector<float>( n * 3 );
+        CoordinateQuantization::Decode( data + header.coords.offset, n, header.min_object_coord, header.max_object_coord, header.coord_bits, view->coord_storage.data() );
+        view->coords = view->coord_storage.data();
+    }
+
+    view->colors = reinterpret_cast<const std::uint8_t*>( data + header.colors.offset );
+
+    if( header.normal_encoding == OctahedralNormal::Float32 )
+    {
+        view->normals = AdoptFloats( data + header.normals.offset, n * 3, &view->normal_storage );
+    }
+    else
+    {
+        view->normal_storage = std::vector<float>( n * 3 );
+        OctahedralNormal::Decode( data + header.normals.offset, n, header.normal_encoding, view->normal_storage.data() );
+        view->normals = view->normal_storage.data();
+    }
+    return true;
+}
+
+struct Measurement
+{
+    double seconds = 0.0;         // 1 回あたりの時間 (中央値)
+    std::size_t iterations = 0;
+    double allocations = 0.0;     // 1 回あたりの確保回数
+    double allocated_bytes = 0.0; // 1 回あたりの確保バイト数
+};
+
+// body を minTime 秒以上かつ minIterations 回以上繰り返して測る
+template <typename Body>
+Measurement Measure( Body&& body, const double minTime, const std::size_t minIterations )
+{
+    using Clock = std::chrono::steady_clock;
+
+    std::vector<double> times;
+    double total = 0.0;
+    std::size_t allocations = 0;
+    std::size_t allocatedBytes = 0;
+    while( times.size() < minIterations || total < minTime )
+    {
+        // times の伸長による確保を数えないよう、body の前後だけで確保数を取る
+        const AllocationSnapshot before;
+        const auto start = Clock::now();
+        body();
+        const double seconds = std::chrono::duration<double>( Clock::now() - start ).count();
+        const AllocationSnapshot after;
+        allocations += after.count - before.count;
+        allocatedBytes += after.bytes - before.bytes;
+        times.push_back( seconds );
+        total += seconds;
+    }
+
+    Measurement measurement;
+    measurement.iterations = times.size();
+    measurement.seconds = Statistics::Summarize( times ).p50;
+    measurement.allocations = double( allocations ) / times.size();
+    measurement.allocated_bytes = double( allocatedBytes ) / times.size();
+    return measurement;
+}
+
+const char* NormalName( const int encoding )
+{
+    return encoding == OctahedralNormal::Oct8 ? "oct8" : encoding == OctahedralNormal::Oct16 ? "oct16" : "float";
+}
+
+std::vector<std::size_t> ParseSizes( const std::string& text )
+{
+    std::vector<std::size_t> sizes;
+    std::size_t begin = 0;
+    while( begin < text.size() )
+    {
+        const std::size_t end = std::min( text.find( ',', begin ), text.size() );
+        const std::size_t size = std::strtoull( text.substr( begin, end - begin ).c_str(), nullptr, 10 );
+        if( size > 0 ) sizes.push_back( size );
+        begin = end + 1;
+    }
+    return sizes;
+}
+
+} // end of namespace
+
+void* operator new( std::size_t size )
+{
+    AllocationCount.fetch_add( 1, std::memory_order_relaxed );
+    AllocationBytes.fetch_add( size, std::memory_order_relaxed );
+    if( void* p = std::malloc( size ? size : 1 ) ) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete( void* p ) noexcept { std::free( p ); }
+void operator delete( void* p, std::size_t ) noexcept { std::free( p ); }
+
+int main( int argc, char* argv[] )
+{
+    std::vector<std::size_t> sizes = { 10000, 100000, 1000000, 10000000, 50000000 };
+    double minTime = 0.5;
+    std::size_t minIterations = 3;
+    for( int i = 1; i < argc; ++i )
+    {
+        const std::string arg = argv[i];
+        if( arg == "--sizes" && i + 1 < argc ) sizes = ParseSizes( argv[++i] );
+        else if( arg == "--min-time" && i + 1 < argc ) minTime = std::atof( argv[++i] );
+        else if( arg == "--min-iterations" && i + 1 < argc ) minIterations = std::max( 1, std::atoi( argv[++i] ) );
+        else
+        {
+            std::fprintf( stderr, "usage: %s [--sizes n,n,...] [--min-time sec] [--min-iterations n]\n", argv[0] );
+            return 1;
+        }
+    }
+
+    const int coordBits[] = { 0, 16, 12, 8 };
+    const int normalEncodings[] = { OctahedralNormal::Float32, OctahedralNormal::Oct16, OctahedralNormal::Oct8 };
+
+    // 展開後の粒子データの大きさ (座標 float32 * 3 + 色 uint8 * 3 + 法線 float32 * 3)
+    const double rawBytesPerParticle = sizeof( float ) * 3 + 3 + sizeof( float ) * 3;
+
+    std::printf( "operation,particles,coord_bits,normal_encoding,message_bytes,iterations,time_ms,raw_gb_per_sec,wire_gb_per_sec,allocations,allocated_bytes\n" );
+    for( const std::size_t n : sizes )
+    {
+        const Particles particles = Generate( n );
+        for( const int bits : coordBits )
+        {
+            for( const int normal : normalEncodings )
+            {
+                const ParticleWireFormat::Header header = MakeHeader( particles, bits, normal );
+                const std::size_t messageBytes = ParticleWireFormat::MessageSize( header );
+
+                std::vector<char> message;
+                const Measurement encode = Measure( [&]() { message = Encode( particles, header ); }, minTime, minIterations );
+
+                ParticleView view;
+                Particles decoded;
+                bool valid = true;
+                const Measurement decode = Measure( [&]() { valid = DecodeInPlace( message, &view ) && valid; }, minTime, minIterations );
+                const Measurement decodeCopy = Measure( [&]() { valid = Decode( message, &decoded ) && valid; }, minTime, minIterations );
+                if( !valid )
+                {
+                    std::fprintf( stderr, "decode failed: particles=%zu coord_bits=%d normal_encoding=%s\n", n, bits, NormalName( normal ) );
+                    return 1;
+                }
+
+                const Measurement* measurements[3] = { &encode, &decode, &decodeCopy };
+                const char* operations[3] = { "encode", "decode", "decode_copy" };
+                for( int i = 0; i < 3; ++i )
+                {
+                    const Measurement& m = *measurements[i];
+                    std::printf( "%s,%zu,%d,%s,%zu,%zu,%.4f,%.3f,%.3f,%.1f,%.0f\n",
+                                 operations[i], n, bits, NormalName( normal ), messageBytes, m.iterations, m.seconds * 1e3,
+                                 n * rawBytesPerParticle / m.seconds / 1e9, messageBytes / m.seconds / 1e9,
+                                 m.allocations, m.allocated_bytes );
+                }
+                std::fflush( stdout );
+            }
+        }
+    }
+
+    return 0;
+}
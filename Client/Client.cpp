@@ -1,6 +1,43 @@
 #include "Client.h"
 #include "ui_Client.h"
 
+#include <QDateTime>
+#include <QFile>
+#include <QFutureWatcher>
+#include <QShortcut>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+#include "../Shared/Trace.h"
+
+namespace
+{
+
+// 受信したメッセージ内のセクションを、コピーせずに ValueArray として参照する
+// ValueArray は QByteArray のコピー (暗黙共有なので参照カウントの増加のみ) を保持し、
+// オブジェクトが破棄されるまで受信バッファを生かしておく
+template <typename T>
+kvs::ValueArray<T> AdoptSection( const QByteArray& message, const std::uint64_t offset, const size_t size )
+{
+    const char* data = message.constData() + offset;
+    if( reinterpret_cast<std::uintptr_t>( data ) % alignof( T ) != 0 )
+    {
+        // 受信バッファ自体が整列していない場合はコピーする
+        kvs::ValueArray<T> values( size );
+        std::memcpy( values.data(), data, sizeof( T ) * size );
+        return values;
+    }
+
+    auto holder = std::make_shared<const QByteArray>( message );
+    T* values = reinterpret_cast<T*>( const_cast<char*>( holder->constData() + offset ) );
+    return kvs::ValueArray<T>( kvs::SharedPointer<T>( holder, values ), size );
+}
+
+} // end of namespace
+
 Client::Client( kvs::qt::Application& app, QWidget *parent )
     : QMainWindow(parent)
     , ui(new Ui::Client)
@@ -15,6 +52,13 @@ Client::Client( kvs::qt::Application& app, QWidget *parent )
 
 Client::~Client()
 {
+    // 展開中のメッセージを待ち、シーンに渡らなかったオブジェクトを破棄する
+    m_decode_pool.waitForDone();
+    while( !m_decode_queue.isEmpty() )
+    {
+        delete m_decode_queue.dequeue().result().object;
+    }
+
     delete ui;
     if( m_binary_socket )
     {
@@ -38,6 +82,12 @@ void Client::initialize()
     connect( ui->disconnectPushButton , &QPushButton::clicked, this, &Client::onDisconnect );   // 切断
     connect( ui->requestPushButton    , &QPushButton::clicked, this, &Client::onRequest );      // 要求(テスト)
     connect( ui->chatPushButton       , &QPushButton::clicked, this, &Client::onChat );         // チャットメッセージ送信
+
+    // Ctrl+Shift+T で受信・展開・表示の処理区間をファイルに書き出す
+    auto* traceShortcut = new QShortcut( QKeySequence( QString::fromUtf8( "Ctrl+Shift+T" ) ), this );
+    connect( traceShortcut, &QShortcut::activated, this, &Client::onDumpTrace );
+    Trace::SetProcessName( "Client" );
+    Trace::SetThreadName( "GUI" );
     this->show();
 }
 
@@ -58,7 +108,7 @@ bool Client::areSocketsConnected() const
            m_text_socket->state() == QAbstractSocket::ConnectedState;
 }
 
-void Client::registerObject( kvs::PointObject* pointObject )
+QPair<int,int> Client::registerObject( kvs::PointObject* pointObject )
 {
     kvs::glsl::ParticleBasedRenderer* renderer = new kvs::glsl::ParticleBasedRenderer();
     renderer->enableShuffle();
@@ -77,8 +127,9 @@ void Client::registerObject( kvs::PointObject* pointObject )
     renderer->setTranslationOffset( translationOffset );
     renderer->setObjectDepth( m_screen->scene()->objectManager()->xform().scaling().z() / m_screen->scene()->camera()->xform().scaling().z() );
 
-    m_server_point_object_ids = m_screen->scene()->registerObject( pointObject, renderer );
+    const auto ids = m_screen->scene()->registerObject( pointObject, renderer );
     m_screen->update();
+    return QPair<int,int>( ids.first, ids.second );
 }
 
 void Client::replaceObject( kvs::PointObject* pointObject )
@@ -87,6 +138,24 @@ void Client::replaceObject( kvs::PointObject* pointObject )
     m_screen->update();
 }
 
+void Client::removeChunkObjects()
+{
+    for( const auto& ids : m_chunk_object_ids )
+    {
+        m_screen->scene()->removeObject( ids.first );
+    }
+    m_chunk_object_ids.clear();
+}
+
+void Client::prepareObject( kvs::PointObject* pointObject )
+{
+    pointObject->setXform( m_screen->scene()->objectManager()->xform() );
+    m_screen->scene()->objectManager()->push_centering_xform();
+    m_screen->scene()->objectManager()->updateMinMaxCoords();
+    m_screen->scene()->objectManager()->updateExternalCoords();
+    m_screen->scene()->objectManager()->pop_centering_xform();
+}
+
 void Client::onConnect()
 {
     const QString address = ui->addressLineEdit->text().trimmed();
@@ -123,6 +192,7 @@ void Client::onDisconnect()
             m_binary_socket->close(); // ソケットを明示的に閉じる
         }
 
+        m_control_encodings.remove( m_binary_socket );
         m_binary_socket->deleteLater(); // メモリ解放は安全なタイミングで
         m_binary_socket = nullptr;
     }
@@ -134,6 +204,7 @@ void Client::onDisconnect()
             m_text_socket->close(); // ソケットを明示的に閉じる
         }
 
+        m_control_encodings.remove( m_text_socket );
         m_text_socket->deleteLater(); // メモリ解放は安全なタイミングで
         m_text_socket = nullptr;
     }
@@ -143,14 +214,29 @@ void Client::onRequest()
 {
     if( !areSocketsConnected() ) return;
 
-    // JSON形式のメッセージを作成
-    QJsonObject jsonMessage;
-    jsonMessage["type"] = QString::fromUtf8( "request");
-
-    QJsonDocument doc( jsonMessage );
-    QString message = doc.toJson( QJsonDocument::Compact );
+    nlohmann::json message;
+    message["type"] = "request";
+    message["stream"] = ui->streamCheckBox->isChecked(); // サンプリング途中の粒子を逐次受け取る
+    message["coord_bits"] = ui->quantizeCheckBox->isChecked() ? 16 : 0; // 座標を 16bit に量子化して受け取る
+    message["normal_encoding"] = ui->octNormalCheckBox->isChecked() ? "oct16" : "float"; // 法線を八面体写像で圧縮して受け取る
+
+    // サンプリング条件 (範囲はサーバ側でも確かめる)
+    message["volume"] = "hydrogen";
+    message["resolution"] = ui->resolutionSpinBox->value();
+    message["repeat"] = ui->repeatSpinBox->value();
+    message["step"] = ui->stepDoubleSpinBox->value();
+    message["seed"] = ui->seedSpinBox->value();
+
+    // 伝達関数のテーブル
+    const auto& colorTable = m_transfer_function.colorMap().table();
+    const auto& opacityTable = m_transfer_function.opacityMap().table();
+    message["transfer_function"] =
+        {
+            { "colors", std::vector<kvs::UInt8>( colorTable.begin(), colorTable.end() ) },
+            { "opacities", std::vector<kvs::Real32>( opacityTable.begin(), opacityTable.end() ) }
+        };
 
-    m_binary_socket->sendTextMessage( message );
+    sendControlMessage( m_binary_socket, message );
 }
 
 void Client::onChat()
@@ -160,20 +246,99 @@ void Client::onChat()
     QString text = ui->chatLineEdit->text().trimmed();
     if( text.isEmpty() ) return; // 何も入力されていない場合は何もしない
 
-    QJsonObject jsonMessage;
-    jsonMessage["type"] = QString::fromUtf8( "chat" );
-    jsonMessage[ QString::fromUtf8( "chat_message" ) ]   = text;
-
-    QJsonDocument doc( jsonMessage );
-    QString message = doc.toJson( QJsonDocument::Compact );
+    nlohmann::json message;
+    if( text.startsWith( QString::fromUtf8( "/join " ) ) ) // "/join <room>" でチャットのルームを移る
+    {
+        message["type"] = "join";
+        message["room"] = text.mid( 6 ).trimmed().toStdString();
+    }
+    else
+    {
+        message["type"] = "chat";
+        message["chat_message"] = text.toStdString();
+    }
 
-    m_text_socket->sendTextMessage( message );
+    sendControlMessage( m_text_socket, message );
     ui->chatLineEdit->clear();
 }
 
+// 処理区間を Chrome のトレース形式 (chrome://tracing や Perfetto で開く) でカレントディレクトリに書き出す
+// サーバ側の区間は http://<サーバ>/trace から取得できる
+void Client::onDumpTrace()
+{
+    const QString filename = QString::fromUtf8( "client-trace-%1.json" ).arg( QDateTime::currentDateTime().toString( QString::fromUtf8( "yyyyMMdd-HHmmss" ) ) );
+    QFile file( filename );
+    if( !file.open( QIODevice::WriteOnly ) )
+    {
+        ui->statusbar->showMessage( QString::fromUtf8( "Failed to write %1" ).arg( filename ), 5000 );
+        return;
+    }
+
+    const std::string json = Trace::Dump();
+    file.write( json.data(), static_cast<qint64>( json.size() ) );
+    ui->statusbar->showMessage( QString::fromUtf8( "Trace written to %1" ).arg( filename ), 5000 );
+}
+
+// 制御メッセージの符号化をサーバに要求する (応答の hello を受け取るまでは JSON で送る)
+void Client::sendHello( QWebSocket* socket )
+{
+    m_control_encodings[ socket ] = ControlEncoding::Json;
+    nlohmann::json message;
+    message["type"] = "hello";
+    message["control_encoding"] = ControlEncoding::Name( m_preferred_control_encoding );
+    sendControlMessage( socket, message );
+}
+
+void Client::sendControlMessage( QWebSocket* socket, const nlohmann::json& message )
+{
+    const ControlEncoding::Encoding encoding = m_control_encodings.value( socket, ControlEncoding::Json );
+    const std::vector<char> data = ControlEncoding::Encode( message, encoding );
+    if( ControlEncoding::IsBinary( encoding ) )
+    {
+        socket->sendBinaryMessage( QByteArray( data.data(), static_cast<qsizetype>( data.size() ) ) );
+    }
+    else
+    {
+        socket->sendTextMessage( QString::fromUtf8( data.data(), static_cast<qsizetype>( data.size() ) ) );
+    }
+}
+
+void Client::receiveControlMessage( QWebSocket* socket, const nlohmann::json& message )
+{
+    if( !message.is_object() ) return; // 不正なメッセージは無視
+
+    const std::string type = message.value( "type", "" );
+    if( type == "chat" )
+    {
+        const QString chatMessage = QString::fromStdString( message.value( "chat_message", "" ) );
+        ui->chatTextBrowser->append( chatMessage );
+    }
+    else if( type == "error" )
+    {
+        // サーバが受け付けなかった要求 (パラメータが範囲外など)
+        const QString errorMessage = QString::fromStdString( message.value( "error_message", "" ) );
+        qWarning() << "Server error:" << errorMessage;
+        ui->statusbar->showMessage( errorMessage, 5000 );
+    }
+    else if( type == "join" )
+    {
+        const QString room = QString::fromStdString( message.value( "room", "" ) );
+        ui->chatTextBrowser->append( QString::fromUtf8( "[joined %1]" ).arg( room ) );
+    }
+    else if( type == "hello" )
+    {
+        // サーバが受け入れた符号化に切り替える (知らない名前であれば JSON のまま)
+        ControlEncoding::Encoding encoding = ControlEncoding::Json;
+        ControlEncoding::FromName( message.value( "control_encoding", "json" ), &encoding );
+        m_control_encodings[ socket ] = encoding;
+        qInfo() << "Control encoding:" << ControlEncoding::Name( encoding );
+    }
+}
+
 void Client::binaryWebsocketConnected()
 {
     qInfo() << "Binary socket connected";
+    sendHello( m_binary_socket );
     updateButtons();
 }
 
@@ -186,6 +351,13 @@ void Client::binaryWebsocketDisconnected()
 void Client::textWebsocketConnected()
 {
     qInfo() << "Text socket connected";
+    sendHello( m_text_socket );
+
+    // チャットはテキスト用のソケットで受け取る (サーバはルームのトピックを購読したソケットにだけ配信する)
+    nlohmann::json join;
+    join["type"] = "join";
+    join["room"] = "lobby";
+    sendControlMessage( m_text_socket, join );
     updateButtons();
 }
 
@@ -199,72 +371,145 @@ void Client::websocketTextMessageReceived(const QString& textMessage)
 {
     qDebug() << __func__;
 
-    QJsonDocument doc = QJsonDocument::fromJson(textMessage.toUtf8());
-    if (!doc.isObject()) return; // JSON 形式でない場合は無視
+    const QByteArray data = textMessage.toUtf8();
+    receiveControlMessage( qobject_cast<QWebSocket*>( sender() ), ControlEncoding::Decode( data.constData(), static_cast<size_t>( data.size() ), ControlEncoding::Json ) );
+}
 
-    QJsonObject jsonObject = doc.object();
-    const QString type = jsonObject.value("type").toString();
+void Client::websocketBinaryMessageReceived(const QByteArray& binaryMessage)
+{
+    qDebug() << "Received binary data size:" << binaryMessage.size() << "bytes";
+    Trace::Scope trace( "client", "receive" );
 
-    if (type == "chat")
+    // 粒子メッセージ以外のバイナリフレームは、ネゴシエーションされた符号化の制御メッセージ
+    if( !ParticleWireFormat::IsParticleMessage( binaryMessage.constData(), static_cast<size_t>( binaryMessage.size() ) ) )
     {
-        QString chatMessage = jsonObject.value("chat_message").toString();
-        ui->chatTextBrowser->append(chatMessage);
+        auto* socket = qobject_cast<QWebSocket*>( sender() );
+        const ControlEncoding::Encoding encoding = m_control_encodings.value( socket, ControlEncoding::Json );
+        if( ControlEncoding::IsBinary( encoding ) )
+        {
+            receiveControlMessage( socket, ControlEncoding::Decode( binaryMessage.constData(), static_cast<size_t>( binaryMessage.size() ), encoding ) );
+        }
+        return;
     }
+
+    // 展開と PointObject の生成はワーカースレッドで行い、GUI スレッドを止めない
+    // シーンへの登録は受信順に行う必要があるので、受信順に future を積んでおき先頭から反映する
+    QFuture<DecodedParticles> future = QtConcurrent::run( &m_decode_pool, [binaryMessage]() { return decodeParticles( binaryMessage ); } );
+    m_decode_queue.enqueue( future );
+
+    auto* watcher = new QFutureWatcher<DecodedParticles>( this );
+    connect( watcher, &QFutureWatcherBase::finished, this, [this, watcher]() {
+        watcher->deleteLater();
+        applyDecodedParticles();
+    } );
+    watcher->setFuture( future );
 }
 
-void Client::websocketBinaryMessageReceived(const QByteArray& binaryMessage)
+Client::DecodedParticles Client::decodeParticles( const QByteArray& binaryMessage )
 {
-    qDebug() << "Received binary data size:" << binaryMessage.size() << "bytes";
-    const char* data_ptr = binaryMessage.constData();
-    size_t offset = 0;
-
-    // 頂点数を読み出す
-    size_t numberOfVertices = 0;
-    std::memcpy( &numberOfVertices, data_ptr + offset, sizeof( size_t ) );
-    offset += sizeof( size_t );
-
-    // 座標（float3 * N）
-    kvs::ValueArray<kvs::Real32> coords( numberOfVertices * 3 );
-    std::memcpy( coords.data(), data_ptr + offset, sizeof( kvs::Real32 ) * 3 * numberOfVertices );
-    offset += sizeof( kvs::Real32 ) * 3 * numberOfVertices;
-
-    // 色（uchar3 * N）
-    kvs::ValueArray<kvs::UInt8> colors( numberOfVertices * 3 );
-    std::memcpy( colors.data(), data_ptr + offset, sizeof( kvs::UInt8 ) * 3 * numberOfVertices );
-    offset += sizeof( kvs::UInt8 ) * 3 * numberOfVertices;
-
-    // 法線（float3 * N）
-    kvs::ValueArray<kvs::Real32> normals( numberOfVertices * 3 );
-    std::memcpy( normals.data(), data_ptr + offset, sizeof( kvs::Real32 ) * 3 * numberOfVertices );
-    offset += sizeof( kvs::Real32 ) * 3 * numberOfVertices;
-
-    // minObjectCoords（float3）
-    kvs::Vec3 minObjectCoords;
-    std::memcpy( minObjectCoords.data(), data_ptr + offset, sizeof( kvs::Real32 ) * 3 );
-    offset += sizeof( kvs::Real32 ) * 3;
-
-    // maxObjectCoords（float3）
-    kvs::Vec3 maxObjectCoords;
-    std::memcpy( maxObjectCoords.data(), data_ptr + offset, sizeof( kvs::Real32 ) * 3 );
-    offset += sizeof( kvs::Real32 ) * 3;
-
-    // kvs::PointObject の生成
+    Trace::Scope trace( "client", "decode" );
+    DecodedParticles decoded;
+    ParticleWireFormat::Header& header = decoded.header;
+    if( !ParticleWireFormat::ReadHeader( binaryMessage.constData(), static_cast<size_t>( binaryMessage.size() ), &header ) )
+    {
+        qWarning() << "Invalid particle message:" << binaryMessage.size() << "bytes";
+        return decoded;
+    }
+
+    decoded.valid = true;
+    if( header.isChunk() && header.number_of_vertices == 0 )
+    {
+        return decoded; // 粒子を含まない最後のチャンク
+    }
+
+    const size_t numberOfVertices = static_cast<size_t>( header.number_of_vertices );
+
+    // float32 のセクションは受信バッファをそのまま参照し、量子化座標・圧縮法線のみ float に展開する
+    const char* data = binaryMessage.constData();
+    kvs::ValueArray<kvs::Real32> coords;
+    if( header.coord_bits == 0 )
+    {
+        coords = AdoptSection<kvs::Real32>( binaryMessage, header.coords.offset, numberOfVertices * 3 );
+    }
+    else
+    {
+        coords.allocate( numberOfVertices * 3 );
+        CoordinateQuantization::Decode( data + header.coords.offset, numberOfVertices, header.min_object_coord, header.max_object_coord, header.coord_bits, coords.data() );
+    }
+
+    const kvs::ValueArray<kvs::UInt8> colors = AdoptSection<kvs::UInt8>( binaryMessage, header.colors.offset, numberOfVertices * 3 );
+
+    kvs::ValueArray<kvs::Real32> normals;
+    if( header.normal_encoding == OctahedralNormal::Float32 )
+    {
+        normals = AdoptSection<kvs::Real32>( binaryMessage, header.normals.offset, numberOfVertices * 3 );
+    }
+    else
+    {
+        normals.allocate( numberOfVertices * 3 );
+        OctahedralNormal::Decode( data + header.normals.offset, numberOfVertices, header.normal_encoding, normals.data() );
+    }
+
+    // バウンディングボックスはストリーム全体(ボリューム)のものを使い、チャンクごとに表示位置がずれないようにする
+    const kvs::Vec3 minObjectCoords( header.min_object_coord[0], header.min_object_coord[1], header.min_object_coord[2] );
+    const kvs::Vec3 maxObjectCoords( header.max_object_coord[0], header.max_object_coord[1], header.max_object_coord[2] );
+
     auto* object = new kvs::PointObject();
     object->setCoords( coords );
     object->setColors( colors );
     object->setNormals( normals );
     object->setMinMaxObjectCoords( minObjectCoords, maxObjectCoords );
     object->setMinMaxExternalCoords( minObjectCoords, maxObjectCoords );
+    decoded.object = object;
+    return decoded;
+}
 
-    object->setXform( m_screen->scene()->objectManager()->xform() );
-    m_screen->scene()->objectManager()->push_centering_xform();
-    m_screen->scene()->objectManager()->updateMinMaxCoords();
-    m_screen->scene()->objectManager()->updateExternalCoords();
-    m_screen->scene()->objectManager()->pop_centering_xform();
+void Client::applyDecodedParticles()
+{
+    // 先に受信したメッセージの展開が終わるまで、後続のメッセージは反映しない
+    while( !m_decode_queue.isEmpty() && m_decode_queue.head().isFinished() )
+    {
+        const DecodedParticles decoded = m_decode_queue.dequeue().result();
+        if( decoded.valid )
+        {
+            showParticles( decoded.header, decoded.object );
+        }
+    }
+}
+
+void Client::showParticles( const ParticleWireFormat::Header& header, kvs::PointObject* object )
+{
+    Trace::Scope trace( "client", header.isChunk() ? "show chunk" : "replace" );
+    if( header.isChunk() )
+    {
+        // 新しいストリームの最初のチャンクで、前回の表示を消す
+        if( header.chunk_index == 0 )
+        {
+            removeChunkObjects();
+            if( m_server_point_object_ids != QPair<int,int>( -1, -1 ) )
+            {
+                m_screen->scene()->removeObject( m_server_point_object_ids.first );
+                m_server_point_object_ids = QPair<int,int>( -1, -1 );
+            }
+        }
+
+        if( object == nullptr )
+        {
+            m_screen->update();
+            return;
+        }
+
+        // チャンクは別々のオブジェクトとしてシーンに追加していく
+        prepareObject( object );
+        m_chunk_object_ids.append( registerObject( object ) );
+        return;
+    }
 
+    prepareObject( object );
+    removeChunkObjects();
     if( m_server_point_object_ids == QPair<int,int>( -1, -1 ) )
     {
-        registerObject( object );
+        m_server_point_object_ids = registerObject( object );
     }
     else
     {
@@ -4,16 +4,22 @@
 #include <QMainWindow>
 #include <QWebSocket>
 
-#include <QJsonObject>
-#include <QJsonDocument>
+#include <QFuture>
+#include <QHash>
+#include <QQueue>
+#include <QThreadPool>
 
 #include <kvs/qt/Application>
 #include <kvs/qt/Screen>
 #include <kvs/StochasticRenderingCompositor>
 
 #include <kvs/PointObject>
+#include <kvs/TransferFunction>
 #include <kvs/ParticleBasedRenderer>
 
+#include "../Shared/ControlEncoding.h"
+#include "../Shared/ParticleWireFormat.h"
+
 QT_BEGIN_NAMESPACE
 namespace Ui {
 class Client;
@@ -32,8 +38,25 @@ private:
     void initialize();
     void updateButtons();
     bool areSocketsConnected() const;
-    void registerObject( kvs::PointObject* pointObject );
+    QPair<int,int> registerObject( kvs::PointObject* pointObject );
     void replaceObject( kvs::PointObject* pointObject );
+    void removeChunkObjects();
+    void prepareObject( kvs::PointObject* pointObject );
+    void sendHello( QWebSocket* socket );
+    void sendControlMessage( QWebSocket* socket, const nlohmann::json& message );
+    void receiveControlMessage( QWebSocket* socket, const nlohmann::json& message );
+
+    // ワーカースレッドで展開した粒子メッセージ
+    struct DecodedParticles
+    {
+        bool valid = false;                    // ヘッダの検証に成功したか
+        ParticleWireFormat::Header header;
+        kvs::PointObject* object = nullptr;    // 粒子を含まない最後のチャンクでは nullptr
+    };
+
+    static DecodedParticles decodeParticles( const QByteArray& binaryMessage );
+    void applyDecodedParticles();
+    void showParticles( const ParticleWireFormat::Header& header, kvs::PointObject* object );
 
     Ui::Client *ui;
     kvs::qt::Screen* m_screen = nullptr;
@@ -41,12 +64,19 @@ private:
     QWebSocket* m_binary_socket = nullptr;
     QWebSocket* m_text_socket = nullptr;
     QPair<int,int> m_server_point_object_ids    = QPair<int,int>( -1, -1 ); // サーバから送られてきたポイントオブジェクト
+    QList<QPair<int,int>> m_chunk_object_ids;                                // チャンクで送られてきたポイントオブジェクト
+    kvs::TransferFunction m_transfer_function = kvs::TransferFunction( 256 ); // サーバに送る伝達関数
+    ControlEncoding::Encoding m_preferred_control_encoding = ControlEncoding::MessagePack; // hello で要求する制御メッセージの符号化
+    QHash<QWebSocket*, ControlEncoding::Encoding> m_control_encodings;                      // ソケットごとにネゴシエーションされた符号化
+    QThreadPool m_decode_pool;                                               // 粒子メッセージの展開用
+    QQueue<QFuture<DecodedParticles>> m_decode_queue;                        // 受信順に並んだ展開中・展開済みのメッセージ
 
 private slots:
     void onConnect();
     void onDisconnect();
     void onRequest();
     void onChat();
+    void onDumpTrace();
 
 private slots: // WebSocket
     void binaryWebsocketConnected();                                        // 接続
@@ -2,6 +2,7 @@ QT  += core gui
 QT  += opengl               # OpenGL サポート（QOpenGLFunctionsなど）
 QT  += openglwidgets        # QOpenGLWidget など
 QT  += websockets
+QT  += concurrent             # 受信データの展開をワーカースレッドで行う
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++17
@@ -206,6 +207,11 @@ SOURCES += \
     main.cpp
 
 HEADERS += \
+    ../Shared/ControlEncoding.h \
+    ../Shared/CoordinateQuantization.h \
+    ../Shared/OctahedralNormal.h \
+    ../Shared/ParticleWireFormat.h \
+    ../Shared/Trace.h \
     Client.h
 
 FORMS += \
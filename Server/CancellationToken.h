@@ -0,0 +1,22 @@
+#ifndef CANCELLATIONTOKEN_H
+#define CANCELLATIONTOKEN_H
+
+#include <atomic>
+#include <memory>
+
+// 処理の取り消し要求
+// 取り消す側 (イベントループ) が true にし、処理する側 (ワーカースレッド) はブロックなどの区切りごとに確かめる
+using CancellationToken = std::shared_ptr<std::atomic<bool>>;
+
+inline CancellationToken MakeCancellationToken()
+{
+    return std::make_shared<std::atomic<bool>>( false );
+}
+
+// cancelled が nullptr の場合は取り消されないものとする
+inline bool IsCancelled( const std::atomic<bool>* cancelled )
+{
+    return cancelled && cancelled->load( std::memory_order_relaxed );
+}
+
+#endif // CANCELLATIONTOKEN_H
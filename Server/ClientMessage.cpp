@@ -0,0 +1,330 @@
+#include "ClientMessage.h"
+
+#include <cstdint>
+#include <vector>
+
+#include "../Shared/CoordinateQuantization.h"
+#include "../Shared/OctahedralNormal.h"
+#include "../Shared/json.hpp"
+
+namespace
+{
+
+// 値を受け取るフィールド
+enum class Field
+{
+    None,
+    Type,
+    ChatMessage,
+    ControlEncoding,
+    Room,
+    Volume,
+    Resolution,
+    Repeat,
+    Step,
+    Seed,
+    Stream,
+    CoordBits,
+    NormalEncoding,
+    TransferFunction,
+    Colors,          // transfer_function.colors
+    Opacities,       // transfer_function.opacities
+    Ignored          // 知らないフィールド (値は読み飛ばす)
+};
+
+Field RootField( const std::string& key )
+{
+    if( key == "type" ) return Field::Type;
+    if( key == "chat_message" ) return Field::ChatMessage;
+    if( key == "control_encoding" ) return Field::ControlEncoding;
+    if( key == "room" ) return Field::Room;
+    if( key == "volume" ) return Field::Volume;
+    if( key == "resolution" ) return Field::Resolution;
+    if( key == "repeat" ) return Field::Repeat;
+    if( key == "step" ) return Field::Step;
+    if( key == "seed" ) return Field::Seed;
+    if( key == "stream" ) return Field::Stream;
+    if( key == "coord_bits" ) return Field::CoordBits;
+    if( key == "normal_encoding" ) return Field::NormalEncoding;
+    if( key == "transfer_function" ) return Field::TransferFunction;
+    return Field::Ignored;
+}
+
+Field TransferFunctionField( const std::string& key )
+{
+    if( key == "colors" ) return Field::Colors;
+    if( key == "opacities" ) return Field::Opacities;
+    return Field::Ignored;
+}
+
+// SAX のイベントを受けて ClientMessage を埋める
+// 型の合わない値を見つけた時点で false を返し、パースを打ち切る
+class Handler : public nlohmann::json_sax<nlohmann::json>
+{
+public:
+    Handler( ClientMessage* message, std::string* error ): m_message( message ), m_error( error ) {}
+
+    bool null() override { return this->scalar( Scalar::Null ); }
+    bool boolean( bool value ) override { m_bool = value; return this->scalar( Scalar::Boolean ); }
+    bool number_integer( number_integer_t value ) override { m_integer = value; m_float = static_cast<double>( value ); return this->scalar( Scalar::Integer ); }
+    bool number_unsigned( number_unsigned_t value ) override { m_unsigned = value; m_float = static_cast<double>( value ); return this->scalar( Scalar::Unsigned ); }
+    bool number_float( number_float_t value, const string_t& ) override { m_float = value; return this->scalar( Scalar::Float ); }
+    bool string( string_t& value ) override { m_string = &value; return this->scalar( Scalar::String ); }
+    bool binary( binary_t& ) override { return this->scalar( Scalar::Binary ); }
+
+    bool start_object( std::size_t ) override
+    {
+        if( m_ignore > 0 ) { ++m_ignore; return true; }
+        if( m_stack.empty() ) { m_stack.push_back( { false, Field::None, 0 } ); return true; }
+
+        const Field field = this->target();
+        if( field == Field::TransferFunction && !m_stack.back().is_array )
+        {
+            m_stack.push_back( { false, Field::TransferFunction, 0 } );
+            return true;
+        }
+        return this->unexpected( field );
+    }
+
+    bool end_object() override
+    {
+        if( m_ignore > 0 ) { --m_ignore; return true; }
+        m_stack.pop_back();
+        return true;
+    }
+
+    bool start_array( std::size_t elements ) override
+    {
+        if( m_ignore > 0 ) { ++m_ignore; return true; }
+        if( m_stack.empty() ) return this->fail( "message must be an object" );
+
+        const Field field = this->target();
+        if( m_stack.back().is_array ) return this->unexpected( field );
+        switch( field )
+        {
+        case Field::Resolution:
+            m_stack.push_back( { true, field, 0 } );
+            return true;
+        case Field::Colors:
+        case Field::Opacities:
+            if( elements != static_cast<std::size_t>( -1 ) && elements > SamplingRequest::MaxTransferFunctionResolution * 3 )
+            {
+                return this->fail( "transfer_function too large" );
+            }
+            m_stack.push_back( { true, field, 0 } );
+            ( field == Field::Colors ) ? m_message->request.colors.clear() : m_message->request.opacities.clear();
+            return true;
+        default:
+            return this->unexpected( field );
+        }
+    }
+
+    bool end_array() override
+    {
+        if( m_ignore > 0 ) { --m_ignore; return true; }
+        const Frame frame = m_stack.back();
+        m_stack.pop_back();
+        if( frame.field == Field::Resolution && frame.count != 3 ) return this->fail( "resolution must be an unsigned integer or an array of 3" );
+        return true;
+    }
+
+    bool key( string_t& key ) override
+    {
+        if( m_ignore > 0 ) return true;
+        m_key = ( m_stack.back().field == Field::TransferFunction ) ? TransferFunctionField( key ) : RootField( key );
+        return true;
+    }
+
+    bool parse_error( std::size_t position, const std::string&, const nlohmann::detail::exception& ) override
+    {
+        return this->fail( "malformed message at byte " + std::to_string( position ) );
+    }
+
+private:
+    enum class Scalar { Null, Boolean, Integer, Unsigned, Float, String, Binary };
+
+    struct Frame
+    {
+        bool is_array;
+        Field field;        // このオブジェクト・配列を値に持つフィールド
+        std::size_t count;  // 配列の要素数
+    };
+
+    ClientMessage* m_message;
+    std::string* m_error;
+    std::vector<Frame> m_stack;
+    Field m_key = Field::None;   // 現在のオブジェクトで最後に読んだキー
+    std::size_t m_ignore = 0;    // 読み飛ばしているオブジェクト・配列の深さ
+
+    bool m_bool = false;
+    std::int64_t m_integer = 0;
+    std::uint64_t m_unsigned = 0;
+    double m_float = 0.0;
+    std::string* m_string = nullptr;
+
+    // 次に来る値が入るフィールド
+    Field target() const
+    {
+        const Frame& frame = m_stack.back();
+        return frame.is_array ? frame.field : m_key;
+    }
+
+    bool fail( const std::string& error )
+    {
+        if( m_error ) *m_error = error;
+        return false;
+    }
+
+    bool unexpected( const Field field )
+    {
+        if( field == Field::Ignored ) { m_ignore = 1; return true; }
+        return this->fail( this->fieldName( field ) + " has an invalid type" );
+    }
+
+    static std::string fieldName( const Field field )
+    {
+        switch( field )
+        {
+        case Field::Type: return "type";
+        case Field::ChatMessage: return "chat_message";
+        case Field::ControlEncoding: return "control_encoding";
+        case Field::Room: return "room";
+        case Field::Volume: return "volume";
+        case Field::Resolution: return "resolution";
+        case Field::Repeat: return "repeat";
+        case Field::Step: return "step";
+        case Field::Seed: return "seed";
+        case Field::Stream: return "stream";
+        case Field::CoordBits: return "coord_bits";
+        case Field::NormalEncoding: return "normal_encoding";
+        case Field::TransferFunction: return "transfer_function";
+        case Field::Colors: return "transfer_function.colors";
+        case Field::Opacities: return "transfer_function.opacities";
+        default: return "value";
+        }
+    }
+
+    static bool isNumber( const Scalar scalar )
+    {
+        return scalar == Scalar::Integer || scalar == Scalar::Unsigned || scalar == Scalar::Float;
+    }
+
+    bool scalar( const Scalar scalar )
+    {
+        if( m_ignore > 0 ) return true;
+        if( m_stack.empty() ) return this->fail( "message must be an object" );
+
+        Frame& frame = m_stack.back();
+        const Field field = this->target();
+        const std::size_t index = frame.count++;
+        SamplingParameters& parameters = m_message->request.parameters;
+
+        if( frame.is_array )
+        {
+            switch( field )
+            {
+            case Field::Resolution:
+                if( scalar != Scalar::Unsigned || index >= 3 ) return this->fail( "resolution must be unsigned integers" );
+                if( m_unsigned > SamplingRequest::MaxResolution ) return this->fail( "resolution out of range" );
+                parameters.dims[index] = static_cast<unsigned int>( m_unsigned );
+                return true;
+            case Field::Colors:
+                if( scalar != Scalar::Unsigned || m_unsigned > 255 ) return this->fail( "transfer_function.colors must be 0-255" );
+                m_message->request.colors.push_back( static_cast<kvs::UInt8>( m_unsigned ) );
+                return true;
+            case Field::Opacities:
+                if( !isNumber( scalar ) ) return this->fail( "transfer_function.opacities must be numbers" );
+                m_message->request.opacities.push_back( static_cast<kvs::Real32>( m_float ) );
+                return true;
+            default:
+                return this->unexpected( field );
+            }
+        }
+
+        switch( field )
+        {
+        case Field::Type:
+            if( scalar != Scalar::String ) break;
+            m_message->type_name = *m_string;
+            if( *m_string == "request" ) m_message->type = ClientMessage::Request;
+            else if( *m_string == "chat" ) m_message->type = ClientMessage::Chat;
+            else if( *m_string == "hello" ) m_message->type = ClientMessage::Hello;
+            else if( *m_string == "join" ) m_message->type = ClientMessage::Join;
+            else m_message->type = ClientMessage::Unknown;
+            return true;
+        case Field::ChatMessage:
+            if( scalar != Scalar::String ) break;
+            m_message->chat_message = std::move( *m_string );
+            m_message->has_chat_message = true;
+            return true;
+        case Field::ControlEncoding:
+            if( scalar != Scalar::String ) break;
+            m_message->control_encoding = std::move( *m_string );
+            return true;
+        case Field::Room:
+            if( scalar != Scalar::String ) break;
+            m_message->room = std::move( *m_string );
+            return true;
+        case Field::Volume:
+            if( scalar != Scalar::String ) break;
+            parameters.volume_id = std::move( *m_string );
+            return true;
+        case Field::Resolution:
+            // 1 つの整数は立方体の解像度
+            if( scalar != Scalar::Unsigned ) break;
+            if( m_unsigned > SamplingRequest::MaxResolution ) return this->fail( "resolution out of range" );
+            parameters.dims[0] = parameters.dims[1] = parameters.dims[2] = static_cast<unsigned int>( m_unsigned );
+            return true;
+        case Field::Repeat:
+            if( scalar != Scalar::Unsigned ) break;
+            if( m_unsigned > SamplingRequest::MaxRepeat ) return this->fail( "repeat out of range" );
+            parameters.repeat = static_cast<std::size_t>( m_unsigned );
+            return true;
+        case Field::Step:
+            if( !isNumber( scalar ) ) break;
+            parameters.step = static_cast<float>( m_float );
+            return true;
+        case Field::Seed:
+            if( scalar != Scalar::Unsigned ) break;
+            parameters.seed = m_unsigned;
+            return true;
+        case Field::Stream:
+            if( scalar != Scalar::Boolean ) break;
+            parameters.chunked = m_bool;
+            return true;
+        case Field::CoordBits:
+            if( scalar != Scalar::Unsigned || ( m_unsigned != 0 && !CoordinateQuantization::IsValidBits( static_cast<int>( m_unsigned ) ) ) )
+            {
+                return this->fail( "coord_bits out of range" );
+            }
+            parameters.coord_bits = static_cast<int>( m_unsigned );
+            return true;
+        case Field::NormalEncoding:
+            if( scalar != Scalar::String ) break;
+            if( *m_string == "float" ) parameters.normal_encoding = OctahedralNormal::Float32;
+            else if( *m_string == "oct8" ) parameters.normal_encoding = OctahedralNormal::Oct8;
+            else if( *m_string == "oct16" ) parameters.normal_encoding = OctahedralNormal::Oct16;
+            else return this->fail( "unknown normal_encoding: " + *m_string );
+            return true;
+        case Field::Ignored:
+            return true;
+        default:
+            break;
+        }
+        return this->fail( this->fieldName( field ) + " has an invalid type" );
+    }
+};
+
+} // end of namespace
+
+bool ClientMessage::parse( std::string_view data, ControlEncoding::Encoding encoding, std::string* error )
+{
+    Handler handler( this, error );
+    if( !nlohmann::json::sax_parse( data.begin(), data.end(), &handler, ControlEncoding::InputFormat( encoding ) ) ) return false;
+    if( type_name.empty() )
+    {
+        if( error ) *error = "type missing or invalid";
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef CLIENTMESSAGE_H
+#define CLIENTMESSAGE_H
+
+#include <string>
+#include <string_view>
+
+#include "../Shared/ControlEncoding.h"
+#include "SamplingRequest.h"
+
+// クライアントから受け取るメッセージ
+// json.hpp の SAX インタフェースで必要なフィールドだけを取り出し、DOM (nlohmann::json) は作らない
+// JSON / MessagePack / CBOR のいずれも同じハンドラで読む
+struct ClientMessage
+{
+    enum Type
+    {
+        Unknown = 0,
+        Request,   // {"type": "request", ...} サンプリング要求
+        Chat,      // {"type": "chat", "chat_message": "..."}
+        Hello,     // {"type": "hello", "control_encoding": "msgpack"} 制御メッセージの符号化の要求
+        Join       // {"type": "join", "room": "..."} チャットのルームを移る
+    };
+
+    Type type = Unknown;
+    std::string type_name;       // "type" に書かれていた文字列 (ログ用)
+    bool has_chat_message = false;
+    std::string chat_message;
+    std::string control_encoding; // Hello のときのみ使う
+    std::string room;             // Join のときのみ使う
+    SamplingRequest request;     // Request のときのみ使う (範囲の確認は SamplingRequest::validate で行う)
+
+    // 不正なメッセージは例外を投げずに false を返し、error に理由を書く
+    bool parse( std::string_view data, ControlEncoding::Encoding encoding, std::string* error );
+};
+
+#endif // CLIENTMESSAGE_H
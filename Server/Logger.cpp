@@ -0,0 +1,250 @@
+#include "Logger.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+// スレッドあたりのキューの行数 (一杯になった分は捨てる)
+const std::size_t QueueCapacity = 1024;
+
+// 書き出しスレッドがキューを見に行く間隔
+const std::chrono::milliseconds WriteInterval( 5 );
+
+struct Record
+{
+    Logger::Level level;
+    bool truncated;
+    std::uint16_t size;
+    int tid;
+    std::chrono::system_clock::time_point time;
+    char text[Logger::MaxLineLength];
+};
+
+// 単一生産者 (ログを出すスレッド)・単一消費者 (書き出しスレッド) のリングバッファ
+struct Queue
+{
+    int tid = 0;
+    Record records[QueueCapacity];
+    alignas( 64 ) std::atomic<std::uint64_t> head{ 0 };    // 次に読む位置 (書き出しスレッドだけが進める)
+    alignas( 64 ) std::atomic<std::uint64_t> tail{ 0 };    // 次に書く位置 (生産者だけが進める)
+    std::atomic<std::uint64_t> dropped{ 0 };               // 一杯で捨てた行数 (生産者だけが増やす)
+    std::uint64_t reported_dropped = 0;                    // 書き出し済みの捨てた行数 (書き出しスレッドのみ)
+};
+
+const char* LevelName( const Logger::Level level )
+{
+    switch( level )
+    {
+    case Logger::Debug: return "DEBUG";
+    case Logger::Info: return "INFO";
+    case Logger::Warning: return "WARNING";
+    case Logger::Error: return "ERROR";
+    default: return "";
+    }
+}
+
+class Writer
+{
+public:
+    Writer() : m_thread( [this]() { this->run(); } ) {}
+
+    ~Writer()
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_mutex );
+            m_stopping = true;
+        }
+        m_condition.notify_all();
+        m_thread.join();
+    }
+
+    Queue* acquire()
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        if( !m_unused.empty() )
+        {
+            Queue* queue = m_unused.back();
+            m_unused.pop_back();
+            return queue;
+        }
+        m_queues.push_back( std::make_unique<Queue>() );
+        m_queues.back()->tid = static_cast<int>( m_queues.size() );
+        return m_queues.back().get();
+    }
+
+    // スレッドの終了時に返却する (残っている行は書き出しスレッドがそのまま書き出す)
+    void release( Queue* queue )
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_unused.push_back( queue );
+    }
+
+    void flush()
+    {
+        std::unique_lock<std::mutex> lock( m_mutex );
+        const std::uint64_t target = ++m_flush_requested;
+        m_condition.notify_all();
+        m_condition.wait( lock, [this, target]() { return m_flush_completed >= target || m_stopping; } );
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock( m_mutex );
+        for( ;; )
+        {
+            m_condition.wait_for( lock, WriteInterval, [this]() { return m_stopping || m_flush_requested > m_flush_completed; } );
+            const bool stopping = m_stopping;
+            const std::uint64_t flushRequested = m_flush_requested;
+
+            // キューの一覧だけをロック中に写し、書き出しはロックの外で行う (生産者の acquire を待たせない)
+            std::vector<Queue*> queues;
+            queues.reserve( m_queues.size() );
+            for( const auto& queue : m_queues ) queues.push_back( queue.get() );
+            lock.unlock();
+            this->drain( queues );
+            lock.lock();
+
+            m_flush_completed = flushRequested;
+            m_condition.notify_all();
+            if( stopping ) return;
+        }
+    }
+
+    void drain( const std::vector<Queue*>& queues )
+    {
+        m_batch.clear();
+        for( Queue* queue : queues )
+        {
+            const std::uint64_t tail = queue->tail.load( std::memory_order_acquire );
+            std::uint64_t head = queue->head.load( std::memory_order_relaxed );
+            for( ; head < tail; ++head ) m_batch.push_back( queue->records[ head % QueueCapacity ] );
+            queue->head.store( head, std::memory_order_release );
+
+            const std::uint64_t dropped = queue->dropped.load( std::memory_order_relaxed );
+            if( dropped != queue->reported_dropped )
+            {
+                Record& record = m_batch.emplace_back();
+                record.level = Logger::Warning;
+                record.truncated = false;
+                record.tid = queue->tid;
+                record.time = std::chrono::system_clock::now();
+                const int size = std::snprintf( record.text, sizeof( record.text ), "[Logger] %llu lines dropped (queue full)",
+                                                static_cast<unsigned long long>( dropped - queue->reported_dropped ) );
+                record.size = static_cast<std::uint16_t>( std::clamp( size, 0, static_cast<int>( sizeof( record.text ) - 1 ) ) );
+                queue->reported_dropped = dropped;
+            }
+        }
+        if( m_batch.empty() ) return;
+
+        // スレッドをまたいだ順序は時刻で揃える
+        std::stable_sort( m_batch.begin(), m_batch.end(), []( const Record& a, const Record& b ) { return a.time < b.time; } );
+
+        m_out.clear();
+        m_err.clear();
+        for( const Record& record : m_batch )
+        {
+            std::string& out = record.level >= Logger::Warning ? m_err : m_out;
+            this->format( record, out );
+        }
+        if( !m_out.empty() ) { std::fwrite( m_out.data(), 1, m_out.size(), stdout ); std::fflush( stdout ); }
+        if( !m_err.empty() ) { std::fwrite( m_err.data(), 1, m_err.size(), stderr ); std::fflush( stderr ); }
+    }
+
+    void format( const Record& record, std::string& out )
+    {
+        using namespace std::chrono;
+        const std::time_t seconds = system_clock::to_time_t( record.time );
+        const auto milliseconds = duration_cast<std::chrono::milliseconds>( record.time.time_since_epoch() ).count() % 1000;
+        std::tm local{};
+#if defined( _WIN32 )
+        localtime_s( &local, &seconds );
+#else
+        localtime_r( &seconds, &local );
+#endif
+        char prefix[64];
+        const std::size_t length = std::strftime( prefix, sizeof( prefix ), "%Y-%m-%d %H:%M:%S", &local );
+        out.append( prefix, length );
+        const int size = std::snprintf( prefix, sizeof( prefix ), ".%03d [%s] [t%d] ", static_cast<int>( milliseconds ), LevelName( record.level ), record.tid );
+        out.append( prefix, static_cast<std::size_t>( size ) );
+        out.append( record.text, record.size );
+        if( record.truncated ) out += "...";
+        out += '\n';
+    }
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping = false;
+    std::uint64_t m_flush_requested = 0;
+    std::uint64_t m_flush_completed = 0;
+    std::deque<std::unique_ptr<Queue>> m_queues;
+    std::vector<Queue*> m_unused;
+    std::vector<Record> m_batch; // 書き出しスレッドのみ
+    std::string m_out;
+    std::string m_err;
+    std::thread m_thread; // 他のメンバを初期化してから開始する
+};
+
+Writer& GetWriter()
+{
+    static Writer writer;
+    return writer;
+}
+
+Queue& LocalQueue()
+{
+    struct Handle
+    {
+        Queue* queue = GetWriter().acquire();
+        ~Handle() { GetWriter().release( queue ); }
+    };
+    thread_local Handle handle;
+    return *handle.queue;
+}
+
+} // end of namespace
+
+bool Logger::LevelFromName( std::string_view name, Level* level )
+{
+    if( name == "debug" ) { *level = Debug; return true; }
+    if( name == "info" ) { *level = Info; return true; }
+    if( name == "warning" ) { *level = Warning; return true; }
+    if( name == "error" ) { *level = Error; return true; }
+    if( name == "off" ) { *level = Off; return true; }
+    return false;
+}
+
+void Logger::Flush()
+{
+    GetWriter().flush();
+}
+
+void Logger::Enqueue( Level level, std::string_view text, bool truncated )
+{
+    Queue& queue = LocalQueue();
+    const std::uint64_t tail = queue.tail.load( std::memory_order_relaxed );
+    if( tail - queue.head.load( std::memory_order_acquire ) >= QueueCapacity )
+    {
+        queue.dropped.store( queue.dropped.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed );
+        return;
+    }
+
+    Record& record = queue.records[ tail % QueueCapacity ];
+    record.level = level;
+    record.truncated = truncated;
+    record.size = static_cast<std::uint16_t>( text.size() );
+    record.tid = queue.tid;
+    record.time = std::chrono::system_clock::now();
+    std::memcpy( record.text, text.data(), text.size() );
+    queue.tail.store( tail + 1, std::memory_order_release );
+}
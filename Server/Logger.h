@@ -0,0 +1,115 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <charconv>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// イベントループを止めない非同期ロガー
+//
+//   SERVER_LOG( Info ) << "Listening on port " << port;
+//
+// 1 行はスタック上のバッファ (MaxLineLength バイト。超えた分は切り詰める) で組み立て、
+// 呼び出し元スレッドのキュー (単一生産者・単一消費者のリングバッファ) に積む
+// 書き出しは専用のスレッドがまとめて行うので、呼び出し元はロックも I/O も待たない
+// キューが一杯のときは行を捨てて数だけ数える (捨てた数は後で書き出す)
+//
+// 無効なレベルの行は、atomic の読み出しと比較 1 回だけで、<< の右辺も評価しない
+// 終了したスレッドのキューは、次に生成されたスレッドが引き継ぐ
+class Logger
+{
+public:
+    enum Level : int
+    {
+        Debug = 0,
+        Info = 1,
+        Warning = 2,
+        Error = 3,
+        Off = 4
+    };
+
+    static constexpr std::size_t MaxLineLength = 240;
+
+    static bool IsEnabled( const Level level ) { return level >= s_level.load( std::memory_order_relaxed ); }
+    static void SetLevel( const Level level ) { s_level.store( level, std::memory_order_relaxed ); }
+    static bool LevelFromName( std::string_view name, Level* level );
+
+    // 積まれている行をすべて書き出すまで待つ (終了前やテスト用)
+    static void Flush();
+
+    // 1 行分のバッファ。破棄されるときにキューに積む
+    class Line
+    {
+    public:
+        explicit Line( const Level level ) : m_level( level ) {}
+        ~Line() { Logger::Enqueue( m_level, std::string_view( m_text, m_size ), m_truncated ); }
+
+        Line( const Line& ) = delete;
+        Line& operator=( const Line& ) = delete;
+
+        Line& operator<<( const std::string_view text ) { this->append( text.data(), text.size() ); return *this; }
+        Line& operator<<( const char* text ) { return *this << std::string_view( text ? text : "(null)" ); }
+        Line& operator<<( const std::string& text ) { return *this << std::string_view( text ); }
+        Line& operator<<( const char c ) { this->append( &c, 1 ); return *this; }
+        Line& operator<<( const bool value ) { return *this << ( value ? "true" : "false" ); }
+        Line& operator<<( const void* pointer )
+        {
+            char buffer[32];
+            const int size = std::snprintf( buffer, sizeof( buffer ), "%p", pointer );
+            this->append( buffer, size > 0 ? static_cast<std::size_t>( size ) : 0 );
+            return *this;
+        }
+
+        template <typename T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value, int>::type = 0>
+        Line& operator<<( const T value )
+        {
+            char buffer[24];
+            const auto result = std::to_chars( buffer, buffer + sizeof( buffer ), value );
+            this->append( buffer, static_cast<std::size_t>( result.ptr - buffer ) );
+            return *this;
+        }
+
+        template <typename T, typename std::enable_if<std::is_floating_point<T>::value, int>::type = 0>
+        Line& operator<<( const T value )
+        {
+            // 浮動小数点数の to_chars は古い macOS の標準ライブラリに無いので snprintf を使う
+            char buffer[32];
+            const int size = std::snprintf( buffer, sizeof( buffer ), "%g", static_cast<double>( value ) );
+            this->append( buffer, size > 0 ? static_cast<std::size_t>( size ) : 0 );
+            return *this;
+        }
+
+    private:
+        void append( const char* data, std::size_t size )
+        {
+            if( size > MaxLineLength - m_size )
+            {
+                size = MaxLineLength - m_size;
+                m_truncated = true;
+            }
+            std::memcpy( m_text + m_size, data, size );
+            m_size += size;
+        }
+
+        Level m_level;
+        std::size_t m_size = 0;
+        bool m_truncated = false;
+        char m_text[MaxLineLength];
+    };
+
+private:
+    static void Enqueue( Level level, std::string_view text, bool truncated );
+
+    static inline std::atomic<int> s_level{ Info };
+};
+
+// level は Debug / Info / Warning / Error
+#define SERVER_LOG( level ) \
+    if( !Logger::IsEnabled( Logger::level ) ) {} else Logger::Line( Logger::level )
+
+#endif // LOGGER_H
@@ -0,0 +1,241 @@
+#include "Metrics.h"
+
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+
+// ヒストグラムのバケットの上限 (秒)。最後に +Inf が付く
+const double BucketBounds[] = { 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0 };
+const std::size_t NumberOfBuckets = sizeof( BucketBounds ) / sizeof( BucketBounds[0] ) + 1;
+
+struct CounterInfo
+{
+    const char* name;
+    const char* help;
+};
+
+const CounterInfo CounterInfos[Metrics::NumberOfCounters] = {
+    { "kvs_server_connections_opened_total", "WebSocket connections opened." },
+    { "kvs_server_connections_closed_total", "WebSocket connections closed." },
+    { "kvs_server_messages_received_total", "Control messages received from clients." },
+    { "kvs_server_requests_total", "Sampling requests accepted." },
+    { "kvs_server_rejected_requests_total", "Sampling requests rejected as invalid." },
+    { "kvs_server_cache_hit_requests_total", "Sampling requests answered from the result cache." },
+    { "kvs_server_shared_requests_total", "Sampling requests that joined an in-progress sampling." },
+    { "kvs_server_sampled_requests_total", "Sampling requests that ran the sampler." },
+    { "kvs_server_cancelled_samplings_total", "Samplings stopped before completion." },
+    { "kvs_server_failed_samplings_total", "Samplings that failed; the waiting requests receive an error." },
+    { "kvs_server_chat_messages_total", "Chat messages published." },
+    { "kvs_server_messages_sent_total", "Messages handed to uWS for sending." },
+    { "kvs_server_bytes_sent_total", "Bytes handed to uWS for sending." },
+};
+
+const CounterInfo GaugeInfos[Metrics::NumberOfGauges] = {
+    { "kvs_server_queued_bytes", "Bytes waiting in the per-socket send queues." },
+    { "kvs_server_buffered_bytes", "Bytes buffered by uWS (last observed per socket)." },
+};
+
+const CounterInfo HistogramInfos[Metrics::NumberOfHistograms] = {
+    { "kvs_server_request_seconds", "Time from accepting a request until all of its messages are queued." },
+    { "kvs_server_sampling_seconds", "Time spent sampling and serializing one request." },
+    { "kvs_server_serialization_seconds", "Time spent writing one sampled block into particle messages." },
+    { "kvs_server_send_queue_seconds", "Time a message waits in the send queue." },
+};
+
+std::uint64_t NextId()
+{
+    static std::atomic<std::uint64_t> id{ 1 };
+    return id.fetch_add( 1, std::memory_order_relaxed );
+}
+
+// 書き込むのは所有スレッドだけなので、fetch_add ではなく load + store で足す
+template <typename T>
+inline void Add( std::atomic<T>& value, const T delta )
+{
+    value.store( value.load( std::memory_order_relaxed ) + delta, std::memory_order_relaxed );
+}
+
+void AppendValue( std::string& out, const char* name, const char* labels, const double value )
+{
+    char line[256];
+    std::snprintf( line, sizeof( line ), "%s%s %.17g\n", name, labels, value );
+    out += line;
+}
+
+void AppendHeader( std::string& out, const char* name, const char* help, const char* type )
+{
+    out += "# HELP ";
+    out += name;
+    out += " ";
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += " ";
+    out += type;
+    out += "\n";
+}
+
+} // end of namespace
+
+struct Metrics::Shard
+{
+    struct HistogramValues
+    {
+        std::atomic<std::uint64_t> buckets[NumberOfBuckets] = {};
+        std::atomic<std::uint64_t> count{ 0 };
+        std::atomic<std::uint64_t> sum_nanoseconds{ 0 };
+    };
+
+    // 他のスレッドの Shard と同じキャッシュラインに載らないようにする
+    alignas( 64 ) std::atomic<std::uint64_t> counters[NumberOfCounters] = {};
+    std::atomic<std::int64_t> gauges[NumberOfGauges] = {};
+    HistogramValues histograms[NumberOfHistograms];
+};
+
+struct Metrics::Shards
+{
+    std::mutex mutex;
+    std::deque<std::unique_ptr<Shard>> all; // 値を残すため、スレッドが終了しても破棄しない
+    std::vector<Shard*> unused;             // 終了したスレッドから返却されたもの
+};
+
+Metrics::Metrics()
+    : m_id( NextId() )
+    , m_shards( std::make_shared<Shards>() )
+{
+}
+
+Metrics::~Metrics() = default;
+
+Metrics::Shard& Metrics::shard()
+{
+    // サーバは 1 プロセスに 1 つなので、スレッドごとに直前の Metrics の Shard だけを覚えておく
+    // スレッドの終了時に Shard を返却し、次に生成されたスレッドが引き継ぐ (値は合計されるだけなので混ざってよい)
+    struct Slot
+    {
+        std::uint64_t owner_id = 0;
+        Shard* shard = nullptr;
+        std::weak_ptr<Shards> shards;
+
+        void release()
+        {
+            if( auto owner = shards.lock() )
+            {
+                std::lock_guard<std::mutex> lock( owner->mutex );
+                owner->unused.push_back( shard );
+            }
+            owner_id = 0;
+            shard = nullptr;
+            shards.reset();
+        }
+
+        ~Slot() { if( shard ) release(); }
+    };
+
+    thread_local Slot slot;
+    if( slot.owner_id == m_id ) return *slot.shard;
+    if( slot.shard ) slot.release();
+
+    std::lock_guard<std::mutex> lock( m_shards->mutex );
+    if( m_shards->unused.empty() )
+    {
+        m_shards->all.push_back( std::make_unique<Shard>() );
+        slot.shard = m_shards->all.back().get();
+    }
+    else
+    {
+        slot.shard = m_shards->unused.back();
+        m_shards->unused.pop_back();
+    }
+    slot.owner_id = m_id;
+    slot.shards = m_shards;
+    return *slot.shard;
+}
+
+void Metrics::increment( Counter counter, std::uint64_t value )
+{
+    Add( this->shard().counters[counter], value );
+}
+
+void Metrics::add( Gauge gauge, std::int64_t delta )
+{
+    Add( this->shard().gauges[gauge], delta );
+}
+
+void Metrics::observe( Histogram histogram, Clock::duration duration )
+{
+    const auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>( duration ).count();
+    const double seconds = nanoseconds * 1e-9;
+    std::size_t bucket = 0;
+    while( bucket < NumberOfBuckets - 1 && seconds > BucketBounds[bucket] ) ++bucket;
+
+    Shard::HistogramValues& values = this->shard().histograms[histogram];
+    Add( values.buckets[bucket], std::uint64_t( 1 ) );
+    Add( values.count, std::uint64_t( 1 ) );
+    Add( values.sum_nanoseconds, static_cast<std::uint64_t>( nanoseconds > 0 ? nanoseconds : 0 ) );
+}
+
+std::string Metrics::render() const
+{
+    std::uint64_t counters[NumberOfCounters] = {};
+    std::int64_t gauges[NumberOfGauges] = {};
+    std::uint64_t buckets[NumberOfHistograms][NumberOfBuckets] = {};
+    std::uint64_t counts[NumberOfHistograms] = {};
+    std::uint64_t sums[NumberOfHistograms] = {};
+    {
+        std::lock_guard<std::mutex> lock( m_shards->mutex );
+        for( const auto& shard : m_shards->all )
+        {
+            for( int i = 0; i < NumberOfCounters; ++i ) counters[i] += shard->counters[i].load( std::memory_order_relaxed );
+            for( int i = 0; i < NumberOfGauges; ++i ) gauges[i] += shard->gauges[i].load( std::memory_order_relaxed );
+            for( int i = 0; i < NumberOfHistograms; ++i )
+            {
+                const Shard::HistogramValues& values = shard->histograms[i];
+                for( std::size_t b = 0; b < NumberOfBuckets; ++b ) buckets[i][b] += values.buckets[b].load( std::memory_order_relaxed );
+                counts[i] += values.count.load( std::memory_order_relaxed );
+                sums[i] += values.sum_nanoseconds.load( std::memory_order_relaxed );
+            }
+        }
+    }
+
+    std::string out;
+    for( int i = 0; i < NumberOfCounters; ++i ) AppendCounter( out, CounterInfos[i].name, CounterInfos[i].help, static_cast<double>( counters[i] ) );
+    for( int i = 0; i < NumberOfGauges; ++i ) AppendGauge( out, GaugeInfos[i].name, GaugeInfos[i].help, static_cast<double>( gauges[i] ) );
+
+    for( int i = 0; i < NumberOfHistograms; ++i )
+    {
+        const char* name = HistogramInfos[i].name;
+        AppendHeader( out, name, HistogramInfos[i].help, "histogram" );
+
+        // バケットは累積値で出力する
+        const std::string bucketName = std::string( name ) + "_bucket";
+        std::uint64_t cumulative = 0;
+        for( std::size_t b = 0; b < NumberOfBuckets; ++b )
+        {
+            cumulative += buckets[i][b];
+            char labels[64];
+            if( b < NumberOfBuckets - 1 ) std::snprintf( labels, sizeof( labels ), "{le=\"%g\"}", BucketBounds[b] );
+            else std::snprintf( labels, sizeof( labels ), "{le=\"+Inf\"}" );
+            AppendValue( out, bucketName.c_str(), labels, static_cast<double>( cumulative ) );
+        }
+        AppendValue( out, ( std::string( name ) + "_sum" ).c_str(), "", sums[i] * 1e-9 );
+        AppendValue( out, ( std::string( name ) + "_count" ).c_str(), "", static_cast<double>( counts[i] ) );
+    }
+    return out;
+}
+
+void Metrics::AppendCounter( std::string& out, const char* name, const char* help, double value )
+{
+    AppendHeader( out, name, help, "counter" );
+    AppendValue( out, name, "", value );
+}
+
+void Metrics::AppendGauge( std::string& out, const char* name, const char* help, double value )
+{
+    AppendHeader( out, name, help, "gauge" );
+    AppendValue( out, name, "", value );
+}
@@ -0,0 +1,87 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// サーバの計測値 (カウンタ・ゲージ・ヒストグラム) を集計し、Prometheus のテキスト形式で出力する
+//
+// 値はスレッドごとの領域 (Shard) に書き込み、出力時に全スレッド分を合計する
+// Shard を書き換えるのはそのスレッドだけなので、記録はロックも read-modify-write 命令も使わない
+// (relaxed な load + store のみ)。スレッドは初めて記録するときに一度だけ登録される
+// スレッドの生成・終了を繰り返しても Shard が増え続けないよう、終了したスレッドの Shard は値を残したまま次のスレッドに引き継ぐ
+// 読み出し側は記録途中の値を見ることがある (ヒストグラムの count と sum がわずかにずれるなど) が、
+// 次回の出力では追いつくので、監視の用途では問題にならない
+class Metrics
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum Counter
+    {
+        ConnectionsOpened,
+        ConnectionsClosed,
+        MessagesReceived,
+        Requests,            // 受け付けたサンプリング要求
+        RejectedRequests,    // 不正な要求・未知のボリューム
+        CacheHitRequests,    // キャッシュから送った要求
+        SharedRequests,      // 進行中の計算に加わった要求
+        SampledRequests,     // サンプリングを実行した要求
+        CancelledSamplings,  // 途中で取り消されたサンプリング
+        FailedSamplings,     // 失敗したサンプリング (要求にはエラーを返す)
+        ChatMessages,
+        MessagesSent,
+        BytesSent,
+        NumberOfCounters
+    };
+
+    enum Gauge
+    {
+        QueuedBytes,   // 送信キューに積まれているバイト数 (全ソケットの合計)
+        BufferedBytes, // uWS が送りきれずに保持しているバイト数 (全ソケットの合計。最後に観測した値)
+        NumberOfGauges
+    };
+
+    enum Histogram
+    {
+        RequestSeconds,        // 要求を受け付けてから全メッセージを送信キューに積むまで
+        SamplingSeconds,       // サンプリング (シリアライズを含む) 全体
+        SerializationSeconds,  // ブロックを粒子メッセージに書き込む処理 (ブロックごと)
+        SendQueueSeconds,      // メッセージが送信キューに積まれてから uWS に渡すまで
+        NumberOfHistograms
+    };
+
+    Metrics();
+    ~Metrics();
+
+    Metrics( const Metrics& ) = delete;
+    Metrics& operator=( const Metrics& ) = delete;
+
+    void increment( Counter counter, std::uint64_t value = 1 );
+    void add( Gauge gauge, std::int64_t delta );
+    void observe( Histogram histogram, Clock::duration duration );
+    void observeSince( Histogram histogram, Clock::time_point start ) { this->observe( histogram, Clock::now() - start ); }
+
+    // 全スレッド分を合計したテキスト (Prometheus exposition format 0.0.4)
+    std::string render() const;
+
+    // render() の結果に、他のコンポーネントから取得した値を追加する
+    static void AppendCounter( std::string& out, const char* name, const char* help, double value );
+    static void AppendGauge( std::string& out, const char* name, const char* help, double value );
+
+private:
+    struct Shard;
+
+    struct Shards;
+
+    Shard& shard();
+
+    const std::uint64_t m_id; // スレッドごとの Shard のキャッシュが、別の Metrics のものと混ざらないようにする
+    std::shared_ptr<Shards> m_shards; // 終了するスレッドが Shard を返却するときに、Metrics が破棄済みでも安全なように共有する
+};
+
+#endif // METRICS_H
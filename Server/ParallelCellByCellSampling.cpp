@@ -0,0 +1,390 @@
+#include "ParallelCellByCellSampling.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+
+#include <kvs/Type>
+
+#include "CancellationToken.h"
+#include "WorkerPool.h"
+
+namespace
+{
+
+// ブロックのサンプリングに必要な、ボリュームと伝達関数から決まる値
+struct SamplingContext
+{
+    std::size_t nx, ny, nz;               // 格子点数
+    float min_value, max_value;           // 伝達関数を適用する値域
+    std::vector<float> density;           // 伝達関数のテーブル番号 -> 粒子密度
+    const kvs::UInt8* colors;             // 伝達関数のカラーテーブル (RGB)
+    std::size_t resolution;               // 伝達関数のテーブル数
+    std::size_t repeat;
+    std::uint64_t seed;
+};
+
+inline std::size_t TableIndex( const SamplingContext& context, const float value )
+{
+    const float range = context.max_value - context.min_value;
+    const float normalized = range > 0.0f ? ( value - context.min_value ) / range : 0.0f;
+    const float index = normalized * static_cast<float>( context.resolution - 1 );
+    return static_cast<std::size_t>( std::clamp( index, 0.0f, static_cast<float>( context.resolution - 1 ) ) );
+}
+
+inline float Trilinear( const float v[8], const float u, const float v_, const float w )
+{
+    const float x00 = v[0] + ( v[1] - v[0] ) * u;
+    const float x10 = v[2] + ( v[3] - v[2] ) * u;
+    const float x01 = v[4] + ( v[5] - v[4] ) * u;
+    const float x11 = v[6] + ( v[7] - v[6] ) * u;
+    const float y0 = x00 + ( x10 - x00 ) * v_;
+    const float y1 = x01 + ( x11 - x01 ) * v_;
+    return y0 + ( y1 - y0 ) * w;
+}
+
+// 三線形補間の解析的な勾配 (セル幅は 1)
+inline void Gradient( const float v[8], const float u, const float v_, const float w, float g[3] )
+{
+    const float u0 = 1.0f - u, v0 = 1.0f - v_, w0 = 1.0f - w;
+    g[0] = v0 * w0 * ( v[1] - v[0] ) + v_ * w0 * ( v[3] - v[2] ) + v0 * w * ( v[5] - v[4] ) + v_ * w * ( v[7] - v[6] );
+    g[1] = u0 * w0 * ( v[2] - v[0] ) + u * w0 * ( v[3] - v[1] ) + u0 * w * ( v[6] - v[4] ) + u * w * ( v[7] - v[5] );
+    g[2] = u0 * v0 * ( v[4] - v[0] ) + u * v0 * ( v[5] - v[1] ) + u0 * v_ * ( v[6] - v[2] ) + u * v_ * ( v[7] - v[3] );
+}
+
+// ブロックごとの乱数列 (粒子数を決める乱数と位置を決める乱数は別の列にし、位置を求めずに粒子数だけを数えられるようにする)
+enum RandomStream : std::uint32_t
+{
+    CountStream = 0,
+    PositionStream = 1
+};
+
+inline std::mt19937 BlockEngine( const SamplingContext& context, const std::size_t k, const RandomStream stream )
+{
+    std::seed_seq seq{
+        static_cast<std::uint32_t>( context.seed ),
+        static_cast<std::uint32_t>( context.seed >> 32 ),
+        static_cast<std::uint32_t>( k ),
+        static_cast<std::uint32_t>( stream ) };
+    return std::mt19937( seq );
+}
+
+// セル (i, j, k) の 8 頂点の値
+template <typename T>
+inline void CellValues( const SamplingContext& context, const T* values, const std::size_t i, const std::size_t j, const std::size_t k, float v[8] )
+{
+    const std::size_t nx = context.nx;
+    const std::size_t nxy = context.nx * context.ny;
+    const std::size_t index = i + nx * j + nxy * k;
+    v[0] = static_cast<float>( values[ index ] );
+    v[1] = static_cast<float>( values[ index + 1 ] );
+    v[2] = static_cast<float>( values[ index + nx ] );
+    v[3] = static_cast<float>( values[ index + nx + 1 ] );
+    v[4] = static_cast<float>( values[ index + nxy ] );
+    v[5] = static_cast<float>( values[ index + nxy + 1 ] );
+    v[6] = static_cast<float>( values[ index + nxy + nx ] );
+    v[7] = static_cast<float>( values[ index + nxy + nx + 1 ] );
+}
+
+// セル中心の値から生成する粒子数を決める (端数は確率的に切り上げる。セルごとに乱数を 1 つだけ使う)
+template <typename Random>
+inline std::size_t CellParticles( const SamplingContext& context, const float v[8], Random& random )
+{
+    const float average = ( v[0] + v[1] + v[2] + v[3] + v[4] + v[5] + v[6] + v[7] ) * 0.125f;
+    const float expected = context.density[ TableIndex( context, average ) ] * static_cast<float>( context.repeat );
+    std::size_t nparticles = static_cast<std::size_t>( expected );
+    if( random() < expected - static_cast<float>( nparticles ) ) ++nparticles;
+    return nparticles;
+}
+
+// k 番目のセルスラブの粒子数 (SampleBlock が生成する数と一致する)
+template <typename T>
+std::size_t CountBlock( const SamplingContext& context, const T* values, const std::size_t k )
+{
+    std::mt19937 engine = BlockEngine( context, k, CountStream );
+    std::uniform_real_distribution<float> distribution( 0.0f, 1.0f );
+    auto random = [&]() { return distribution( engine ); };
+
+    std::size_t count = 0;
+    float v[8];
+    for( std::size_t j = 0; j + 1 < context.ny; ++j )
+    {
+        for( std::size_t i = 0; i + 1 < context.nx; ++i )
+        {
+            CellValues( context, values, i, j, k, v );
+            count += CellParticles( context, v, random );
+        }
+    }
+    return count;
+}
+
+// k 番目のセルスラブ (z = k .. k+1) をサンプリングする
+// 先に粒子数を数えて各配列を確保しておき、追加による再確保を起こさない
+template <typename T>
+void SampleBlock( const SamplingContext& context, const T* values, const std::size_t k, ParallelCellByCellSampling::Block* block )
+{
+    const std::size_t count = CountBlock( context, values, k );
+    block->coords.reserve( count * 3 );
+    block->colors.reserve( count * 3 );
+    block->normals.reserve( count * 3 );
+    if( count == 0 ) return;
+
+    std::mt19937 countEngine = BlockEngine( context, k, CountStream );
+    std::mt19937 engine = BlockEngine( context, k, PositionStream );
+    std::uniform_real_distribution<float> distribution( 0.0f, 1.0f );
+    auto countRandom = [&]() { return distribution( countEngine ); };
+    auto random = [&]() { return distribution( engine ); };
+
+    float v[8];
+    for( std::size_t j = 0; j + 1 < context.ny; ++j )
+    {
+        for( std::size_t i = 0; i + 1 < context.nx; ++i )
+        {
+            CellValues( context, values, i, j, k, v );
+            const std::size_t nparticles = CellParticles( context, v, countRandom );
+            if( nparticles == 0 ) continue;
+
+            // セル内でメトロポリス法により密度に比例した位置を選ぶ
+            float current[3] = { random(), random(), random() };
+            float current_value = Trilinear( v, current[0], current[1], current[2] );
+            float current_density = context.density[ TableIndex( context, current_value ) ];
+            for( std::size_t n = 0; n < nparticles; ++n )
+            {
+                const float trial[3] = { random(), random(), random() };
+                const float trial_value = Trilinear( v, trial[0], trial[1], trial[2] );
+                const float trial_density = context.density[ TableIndex( context, trial_value ) ];
+                if( trial_density >= current_density || random() * current_density < trial_density )
+                {
+                    std::memcpy( current, trial, sizeof( current ) );
+                    current_value = trial_value;
+                    current_density = trial_density;
+                }
+
+                float gradient[3];
+                Gradient( v, current[0], current[1], current[2], gradient );
+                const kvs::UInt8* color = context.colors + 3 * TableIndex( context, current_value );
+
+                block->coords.push_back( static_cast<float>( i ) + current[0] );
+                block->coords.push_back( static_cast<float>( j ) + current[1] );
+                block->coords.push_back( static_cast<float>( k ) + current[2] );
+                block->colors.insert( block->colors.end(), color, color + 3 );
+                block->normals.insert( block->normals.end(), gradient, gradient + 3 );
+            }
+        }
+    }
+}
+
+// pool を指定しなかったサンプラが使う補助スレッド (プロセスで 1 つ)
+WorkerPool& DefaultPool()
+{
+    static WorkerPool pool;
+    return pool;
+}
+
+// [0, count) を呼び出し元スレッドと pool のスレッド (合わせて最大 numberOfThreads 本) で動的に分配して処理する
+//
+// pool には補助のジョブを積むだけで、呼び出し元も同じように処理を進めるので、pool のスレッドが
+// 他のジョブ (別の要求のサンプリングなど) で埋まっていても止まらない
+// 呼び出し元が全体を処理し終えた後に始まった補助のジョブは、function に触れずに戻る
+template <typename Function>
+void ParallelFor( const std::size_t count, const unsigned int numberOfThreads, WorkerPool& pool, Function function )
+{
+    struct State
+    {
+        std::atomic<std::size_t> next{ 0 };
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::size_t running = 0; // function を実行している補助のジョブ数
+        bool closed = false;     // 呼び出し元が戻る (以降に始まった補助のジョブは何もしない)
+    };
+    auto state = std::make_shared<State>();
+
+    const std::size_t participants = std::min<std::size_t>( { std::size_t( numberOfThreads ), count, pool.numberOfThreads() + 1 } );
+    for( std::size_t t = 1; t < participants; ++t )
+    {
+        pool.submit( [state, count, body = &function]()
+                     {
+                         {
+                             std::lock_guard<std::mutex> lock( state->mutex );
+                             if( state->closed ) return;
+                             ++state->running;
+                         }
+                         for( std::size_t index = state->next++; index < count; index = state->next++ ) ( *body )( index );
+                         {
+                             std::lock_guard<std::mutex> lock( state->mutex );
+                             --state->running;
+                         }
+                         state->condition.notify_all();
+                     } );
+    }
+
+    for( std::size_t index = state->next++; index < count; index = state->next++ ) function( index );
+
+    // 処理中の補助のジョブが終わるのを待つ (function は呼び出し元のスタックにある)
+    std::unique_lock<std::mutex> lock( state->mutex );
+    state->closed = true;
+    state->condition.wait( lock, [&state]() { return state->running == 0; } );
+}
+
+} // end of namespace
+
+ParallelCellByCellSampling::ParallelCellByCellSampling(
+    const std::size_t repeat,
+    const float step,
+    const kvs::TransferFunction& tfunc,
+    const std::uint64_t seed,
+    const unsigned int numberOfThreads,
+    WorkerPool* pool )
+    : m_repeat( repeat )
+    , m_step( step )
+    , m_tfunc( tfunc )
+    , m_seed( seed )
+    , m_number_of_threads( std::max( numberOfThreads, 1u ) )
+    , m_pool( pool )
+{
+}
+
+// 粒子半径をサンプリング間隔の半分としたときに、間隔 step の区間で不透明度 opacity を与える密度
+// (半径 r の粒子が密度 ρ で一様に分布するとき、長さ step の区間を光線が抜ける確率は exp( -ρ π r^2 step ))
+// kvs::CellByCellMetropolisSampling の密度 (カメラから求めた粒子の大きさによる) とは異なる
+float ParallelCellByCellSampling::ParticleDensity( const float opacity, const float step )
+{
+    const float radius = step * 0.5f;
+    const float area = 3.14159265f * radius * radius;
+    const float alpha = std::min( opacity, 0.999f );
+    return -std::log( 1.0f - alpha ) / ( area * step );
+}
+
+bool ParallelCellByCellSampling::isSupported( const kvs::StructuredVolumeObject& volume )
+{
+    return volume.gridType() == kvs::StructuredVolumeObject::Uniform && volume.veclen() == 1;
+}
+
+kvs::PointObject* ParallelCellByCellSampling::exec( const kvs::StructuredVolumeObject& volume ) const
+{
+    std::vector<Block> blocks = this->sample( volume );
+
+    const std::size_t numberOfVertices = NumberOfVertices( blocks );
+    kvs::ValueArray<kvs::Real32> coords( numberOfVertices * 3 );
+    kvs::ValueArray<kvs::UInt8> colors( numberOfVertices * 3 );
+    kvs::ValueArray<kvs::Real32> normals( numberOfVertices * 3 );
+    this->gather( blocks, { coords.data(), colors.data(), normals.data() } );
+
+    auto* object = new kvs::PointObject();
+    object->setCoords( coords );
+    object->setColors( colors );
+    object->setNormals( normals );
+    object->setMinMaxObjectCoords( volume.minObjectCoord(), volume.maxObjectCoord() );
+    object->setMinMaxExternalCoords( volume.minExternalCoord(), volume.maxExternalCoord() );
+    return object;
+}
+
+std::size_t ParallelCellByCellSampling::NumberOfVertices( const std::vector<Block>& blocks )
+{
+    std::size_t numberOfVertices = 0;
+    for( const auto& block : blocks ) numberOfVertices += block.numberOfVertices();
+    return numberOfVertices;
+}
+
+void ParallelCellByCellSampling::gather( std::vector<Block>& blocks, const Destination& destination ) const
+{
+    // ブロックごとの結果を連結する (書き込み先はブロックごとに独立しているので並列にコピーする)
+    std::vector<std::size_t> offsets( blocks.size() + 1, 0 );
+    for( std::size_t b = 0; b < blocks.size(); ++b )
+    {
+        offsets[ b + 1 ] = offsets[ b ] + blocks[ b ].numberOfVertices();
+    }
+
+    auto* coords = static_cast<char*>( destination.coords );
+    auto* colors = static_cast<char*>( destination.colors );
+    auto* normals = static_cast<char*>( destination.normals );
+    ParallelFor( blocks.size(), m_number_of_threads, m_pool ? *m_pool : DefaultPool(), [&]( const std::size_t b )
+    {
+        Block& block = blocks[ b ];
+        const std::size_t offset = offsets[ b ] * 3;
+        if( !block.coords.empty() )
+        {
+            std::memcpy( coords + offset * sizeof( kvs::Real32 ), block.coords.data(), block.coords.size() * sizeof( kvs::Real32 ) );
+            std::memcpy( colors + offset * sizeof( kvs::UInt8 ), block.colors.data(), block.colors.size() * sizeof( kvs::UInt8 ) );
+            std::memcpy( normals + offset * sizeof( kvs::Real32 ), block.normals.data(), block.normals.size() * sizeof( kvs::Real32 ) );
+        }
+        block = Block(); // コピーし終えたものから解放する
+    } );
+}
+
+std::vector<ParallelCellByCellSampling::Block> ParallelCellByCellSampling::sample( const kvs::StructuredVolumeObject& volume ) const
+{
+    const kvs::Vec3ui resolution = volume.resolution();
+    std::vector<Block> blocks( resolution[2] > 1 ? resolution[2] - 1 : 0 );
+    this->sample( volume, [&blocks]( const std::size_t k, Block&& block ) { blocks[k] = std::move( block ); } );
+    return blocks;
+}
+
+bool ParallelCellByCellSampling::sample( const kvs::StructuredVolumeObject& volume, const BlockCallback& callback, const std::atomic<bool>* cancelled, const CountCallback& counted ) const
+{
+    const kvs::Vec3ui resolution = volume.resolution();
+    if( !isSupported( volume ) || resolution[0] < 2 || resolution[1] < 2 || resolution[2] < 2 ) return false;
+
+    SamplingContext context;
+    context.nx = resolution[0];
+    context.ny = resolution[1];
+    context.nz = resolution[2];
+    context.min_value = m_tfunc.hasRange() ? m_tfunc.minValue() : static_cast<float>( volume.minValue() );
+    context.max_value = m_tfunc.hasRange() ? m_tfunc.maxValue() : static_cast<float>( volume.maxValue() );
+    context.colors = m_tfunc.colorMap().table().data();
+    context.resolution = std::min( m_tfunc.colorMap().resolution(), m_tfunc.opacityMap().resolution() );
+    context.repeat = m_repeat;
+    context.seed = m_seed;
+
+    // 不透明度 -> 粒子密度 (単位体積あたりの粒子数)
+    const kvs::Real32* opacities = m_tfunc.opacityMap().table().data();
+    context.density.resize( context.resolution );
+    for( std::size_t i = 0; i < context.resolution; ++i ) context.density[i] = ParticleDensity( opacities[i], m_step );
+
+    const std::size_t numberOfBlocks = context.nz - 1;
+    auto run = [&]( const auto* values )
+    {
+        WorkerPool& pool = m_pool ? *m_pool : DefaultPool();
+        if( counted )
+        {
+            // 粒子数だけを先に数える (位置を求めないので、サンプリングに比べて十分に軽い)
+            std::vector<std::size_t> counts( numberOfBlocks, 0 );
+            ParallelFor( numberOfBlocks, m_number_of_threads, pool, [&]( const std::size_t k )
+            {
+                if( IsCancelled( cancelled ) ) return;
+                counts[k] = CountBlock( context, values, k );
+            } );
+            if( IsCancelled( cancelled ) ) return;
+            counted( counts );
+        }
+
+        ParallelFor( numberOfBlocks, m_number_of_threads, pool, [&]( const std::size_t k )
+        {
+            if( IsCancelled( cancelled ) ) return; // 取り消された場合は残りのブロックを読み飛ばす
+            Block block;
+            SampleBlock( context, values, k, &block );
+            callback( k, std::move( block ) );
+        } );
+    };
+
+    const void* values = volume.values().data();
+    switch( volume.values().typeID() )
+    {
+    case kvs::Type::TypeInt8:   run( static_cast<const kvs::Int8*>( values ) ); break;
+    case kvs::Type::TypeUInt8:  run( static_cast<const kvs::UInt8*>( values ) ); break;
+    case kvs::Type::TypeInt16:  run( static_cast<const kvs::Int16*>( values ) ); break;
+    case kvs::Type::TypeUInt16: run( static_cast<const kvs::UInt16*>( values ) ); break;
+    case kvs::Type::TypeInt32:  run( static_cast<const kvs::Int32*>( values ) ); break;
+    case kvs::Type::TypeUInt32: run( static_cast<const kvs::UInt32*>( values ) ); break;
+    case kvs::Type::TypeReal32: run( static_cast<const kvs::Real32*>( values ) ); break;
+    case kvs::Type::TypeReal64: run( static_cast<const kvs::Real64*>( values ) ); break;
+    default: return false;
+    }
+
+    return !IsCancelled( cancelled );
+}
@@ -0,0 +1,84 @@
+#ifndef PARALLELCELLBYCELLSAMPLING_H
+#define PARALLELCELLBYCELLSAMPLING_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include <kvs/PointObject>
+#include <kvs/StructuredVolumeObject>
+#include <kvs/TransferFunction>
+
+class WorkerPool;
+
+// 構造格子(Uniform)ボリューム向けのマルチスレッド版 Cell-by-Cell Metropolis サンプリング
+//
+// セルを z 方向のスラブ(ブロック)単位に分け、空いたスレッドから順にブロックを処理する
+// 処理するのは呼び出し元スレッドと WorkerPool のスレッドで、呼び出しごとにスレッドは生成しない
+// (pool を省略した場合は、プロセスで共有する補助用の WorkerPool を使う)
+// 乱数はブロックごとに (seed, ブロック番号) から初期化するので、スレッド数によらず結果は同じになる
+// 出力は kvs::CellByCellMetropolisSampling と同じ coords / colors / normals のレイアウト
+// ただし粒子密度の式は KVS と同じではない (KVS は描画時の粒子の大きさをカメラから求めて密度を決めるが、
+// ここではカメラを持たないので粒子半径を step / 2 とする。ParticleDensity() を参照)
+// そのため同じ伝達関数・repeat・step でも粒子数は kvs::CellByCellMetropolisSampling と一致しない
+class ParallelCellByCellSampling
+{
+public:
+    // 1 ブロック分のサンプリング結果
+    struct Block
+    {
+        std::vector<kvs::Real32> coords;
+        std::vector<kvs::UInt8> colors;
+        std::vector<kvs::Real32> normals;
+
+        std::size_t numberOfVertices() const { return coords.size() / 3; }
+    };
+
+    // gather() の書き出し先 (各配列の先頭。送信バッファの途中など、float の境界に揃っていなくてよい)
+    struct Destination
+    {
+        void* coords;
+        void* colors;
+        void* normals;
+    };
+
+    // ブロックが完成するたびに呼ばれる (複数のスレッドから同時に呼ばれることがある)
+    using BlockCallback = std::function<void( std::size_t blockIndex, Block&& block )>;
+    // サンプリングを始める前に、各ブロックの粒子数 (blockVertices[k] が k 番目のブロック) を渡す
+    using CountCallback = std::function<void( const std::vector<std::size_t>& blockVertices )>;
+
+    ParallelCellByCellSampling(
+        const std::size_t repeat,
+        const float step,
+        const kvs::TransferFunction& tfunc,
+        const std::uint64_t seed = 0,
+        const unsigned int numberOfThreads = std::thread::hardware_concurrency(),
+        WorkerPool* pool = nullptr );
+
+    static bool isSupported( const kvs::StructuredVolumeObject& volume );
+    // 不透明度 opacity のセルに生成する、単位体積 (1 セル) あたり repeat 1 回分の粒子数
+    static float ParticleDensity( const float opacity, const float step );
+
+    kvs::PointObject* exec( const kvs::StructuredVolumeObject& volume ) const;
+    std::vector<Block> sample( const kvs::StructuredVolumeObject& volume ) const;
+    // cancelled が true になると、未着手のブロックを処理せずに false を返す
+    // counted を指定すると、先に全ブロックの粒子数を数えて渡してから (呼び出し元のスレッドで) サンプリングを始める
+    // (粒子数はサンプリングと別の乱数列で決めるので、数えた値と callback に渡るブロックの粒子数は一致する)
+    bool sample( const kvs::StructuredVolumeObject& volume, const BlockCallback& callback, const std::atomic<bool>* cancelled = nullptr, const CountCallback& counted = nullptr ) const;
+
+    static std::size_t NumberOfVertices( const std::vector<Block>& blocks );
+    void gather( std::vector<Block>& blocks, const Destination& destination ) const;
+
+private:
+    std::size_t m_repeat;
+    float m_step;
+    kvs::TransferFunction m_tfunc;
+    std::uint64_t m_seed;
+    unsigned int m_number_of_threads; // 呼び出し元スレッドを含む (pool のスレッド数 + 1 が上限)
+    WorkerPool* m_pool;
+};
+
+#endif // PARALLELCELLBYCELLSAMPLING_H
@@ -0,0 +1,143 @@
+#include "ParticleChunkAssembler.h"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <utility>
+
+namespace
+{
+
+const std::size_t MinChunkVertices = 16 * 1024;
+const std::size_t MaxChunkVertices = 1024 * 1024;
+
+} // end of namespace
+
+ParticleChunkAssembler::ParticleChunkAssembler(
+    const kvs::Vec3& minObjectCoord,
+    const kvs::Vec3& maxObjectCoord,
+    const int coordBits,
+    const int normalEncoding,
+    const bool progressive,
+    Emit emit )
+    : m_progressive( progressive )
+    , m_emit( std::move( emit ) )
+    , m_threshold( progressive ? MinChunkVertices : std::numeric_limits<std::size_t>::max() )
+{
+    m_header.flags = progressive ? ParticleWireFormat::ChunkFlag : 0;
+    m_header.coord_bits = static_cast<std::uint8_t>( coordBits );
+    m_header.normal_encoding = static_cast<std::uint8_t>( normalEncoding );
+    for( int i = 0; i < 3; ++i )
+    {
+        m_header.min_object_coord[i] = minObjectCoord[i];
+        m_header.max_object_coord[i] = maxObjectCoord[i];
+    }
+}
+
+void ParticleChunkAssembler::reserve( const std::vector<std::size_t>& blockVertices )
+{
+    if( m_progressive ) return;
+
+    m_offsets.assign( blockVertices.size() + 1, 0 );
+    for( std::size_t b = 0; b < blockVertices.size(); ++b ) m_offsets[ b + 1 ] = m_offsets[ b ] + blockVertices[ b ];
+
+    m_message_header = m_header;
+    m_message_header.number_of_vertices = m_offsets.back();
+    ParticleWireFormat::ComputeLayout( &m_message_header );
+    m_message = ParticleWireFormat::Allocate( m_message_header );
+    m_reserved = true;
+}
+
+void ParticleChunkAssembler::add( const std::size_t blockIndex, Block&& block )
+{
+    if( block.numberOfVertices() == 0 ) return;
+
+    if( m_reserved )
+    {
+        this->add( blockIndex, block.coords.data(), block.colors.data(), block.normals.data(), block.numberOfVertices() );
+        return; // block は呼び出し元で解放される
+    }
+
+    std::vector<Block> blocks;
+    {
+        std::lock_guard<std::mutex> lock( m_pending_mutex );
+        m_pending_vertices += block.numberOfVertices();
+        m_pending.push_back( std::move( block ) );
+        if( m_pending_vertices < m_threshold ) return;
+
+        blocks.swap( m_pending );
+        m_pending_vertices = 0;
+        m_threshold = std::min( m_threshold * 2, MaxChunkVertices );
+    }
+
+    // 書き出しはロックの外で行い、他のスレッドのブロック追加を妨げない
+    this->emit( this->encode( blocks ), false );
+}
+
+void ParticleChunkAssembler::add( const std::size_t blockIndex, const float* coords, const std::uint8_t* colors, const float* normals, const std::size_t count )
+{
+    if( count == 0 ) return;
+
+    if( !m_reserved )
+    {
+        Block block;
+        block.coords.assign( coords, coords + count * 3 );
+        block.colors.assign( colors, colors + count * 3 );
+        block.normals.assign( normals, normals + count * 3 );
+        this->add( blockIndex, std::move( block ) );
+        return;
+    }
+
+    // ブロックごとに書き込む範囲は重ならないので、ロックは要らない
+    // (粒子数が reserve() の値と異なっても (起こらない)、他のブロックの範囲には書き込まない)
+    if( blockIndex + 1 >= m_offsets.size() ) return;
+    const std::size_t first = m_offsets[ blockIndex ];
+    const std::size_t size = std::min( count, m_offsets[ blockIndex + 1 ] - first );
+    ParticleWireFormat::WriteParticles( m_message_header, m_message.data(), first, size, coords, colors, normals );
+}
+
+void ParticleChunkAssembler::finish()
+{
+    if( m_reserved )
+    {
+        m_reserved = false;
+        this->emit( std::move( m_message ), true );
+        return;
+    }
+
+    std::vector<Block> blocks;
+    {
+        std::lock_guard<std::mutex> lock( m_pending_mutex );
+        blocks.swap( m_pending );
+        m_pending_vertices = 0;
+    }
+    this->emit( this->encode( blocks ), true );
+}
+
+std::vector<char> ParticleChunkAssembler::encode( std::vector<Block>& blocks ) const
+{
+    // 溜めたブロックを連結せず、メッセージの各セクションへ直接書き込む
+    ParticleWireFormat::Header header = m_header;
+    header.number_of_vertices = ParallelCellByCellSampling::NumberOfVertices( blocks );
+    ParticleWireFormat::ComputeLayout( &header );
+    std::vector<char> buffer = ParticleWireFormat::Allocate( header );
+
+    std::size_t first = 0;
+    for( auto& block : blocks )
+    {
+        const std::size_t count = block.numberOfVertices();
+        ParticleWireFormat::WriteParticles( header, buffer.data(), first, count, block.coords.data(), block.colors.data(), block.normals.data() );
+        first += count;
+        block = Block(); // 書き込んだものから解放する
+    }
+    return buffer;
+}
+
+void ParticleChunkAssembler::emit( std::vector<char>&& buffer, const bool last )
+{
+    // 番号付けと emit を同じロックの中で行い、番号順に送られるようにする
+    std::lock_guard<std::mutex> lock( m_emit_mutex );
+    if( m_progressive ) ParticleWireFormat::SetChunkIndex( buffer, m_next_index, last );
+    m_next_index++;
+    m_emit( std::make_shared<const std::vector<char>>( std::move( buffer ) ) );
+}
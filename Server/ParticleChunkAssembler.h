@@ -0,0 +1,66 @@
+#ifndef PARTICLECHUNKASSEMBLER_H
+#define PARTICLECHUNKASSEMBLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <kvs/Vector3>
+
+#include "../Shared/ParticleWireFormat.h"
+#include "ParallelCellByCellSampling.h"
+#include "SharedBuffer.h"
+
+// サンプラが出力するブロックをまとめて粒子メッセージ (ParticleWireFormat) にし、完成した順に emit する
+//
+// progressive が true のときはチャンク (ChunkFlag) として逐次 emit する
+// 最初のチャンクは小さくして表示までの時間を短くし、以降は倍々に大きくしてメッセージ数を抑える
+// progressive が false のときは finish() でまとめて 1 メッセージだけを emit する
+// その場合、サンプリングの前に reserve() でブロックごとの粒子数を渡しておくと、メッセージを先に確保し、
+// add() されたブロックをメッセージ内の位置へ直接書き込んですぐに解放する (ピークのメモリはほぼメッセージ 1 つ分)
+// reserve() しなければ、ブロックを finish() まで溜めてからまとめて書き込む
+// emit はチャンク番号の順に呼ばれる (add は複数のスレッドから同時に呼んでよい)
+class ParticleChunkAssembler
+{
+public:
+    using Block = ParallelCellByCellSampling::Block;
+    using Emit = std::function<void( SharedBuffer chunk )>;
+
+    ParticleChunkAssembler(
+        const kvs::Vec3& minObjectCoord,
+        const kvs::Vec3& maxObjectCoord,
+        const int coordBits, // 0: float32, 8-16: 座標を量子化する
+        const int normalEncoding, // OctahedralNormal::Encoding
+        const bool progressive,
+        Emit emit );
+
+    void reserve( const std::vector<std::size_t>& blockVertices ); // progressive でないときのみ
+    void add( std::size_t blockIndex, Block&& block );
+    // 連続した配列の count 個の粒子を 1 ブロックとして追加する (reserve() 済みであればブロックを作らずに書き込む)
+    void add( std::size_t blockIndex, const float* coords, const std::uint8_t* colors, const float* normals, std::size_t count );
+    void finish();
+
+    std::uint32_t numberOfChunks() const { return m_next_index; }
+
+private:
+    std::vector<char> encode( std::vector<Block>& blocks ) const;
+    void emit( std::vector<char>&& buffer, const bool last );
+
+    ParticleWireFormat::Header m_header; // チャンク番号・粒子数以外の共通部分
+    bool m_progressive;
+    Emit m_emit;
+    std::vector<Block> m_pending;   // チャンクの大きさに満たないブロックを溜めておく
+    bool m_reserved = false;                 // reserve() 済み (以降 m_message に直接書き込む)
+    ParticleWireFormat::Header m_message_header;
+    std::vector<char> m_message;
+    std::vector<std::size_t> m_offsets;      // ブロック番号 -> メッセージ内の最初の粒子の番号 (末尾は総数)
+    std::size_t m_pending_vertices = 0;
+    std::size_t m_threshold;        // 次のチャンクの粒子数の目安
+    std::uint32_t m_next_index = 0;
+    std::mutex m_pending_mutex;
+    std::mutex m_emit_mutex;
+};
+
+#endif // PARTICLECHUNKASSEMBLER_H
@@ -0,0 +1,75 @@
+#include "ResultCache.h"
+
+ResultCache::ResultCache( std::size_t capacityInBytes )
+    : m_capacity( capacityInBytes )
+{
+}
+
+SharedBufferList ResultCache::find( const SamplingParameters& parameters )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto found = m_index.find( parameters );
+    if( found == m_index.end() )
+    {
+        ++m_number_of_misses;
+        return {};
+    }
+
+    ++m_number_of_hits;
+    m_entries.splice( m_entries.begin(), m_entries, found->second );
+    return found->second->messages;
+}
+
+void ResultCache::insert( const SamplingParameters& parameters, SharedBufferList messages )
+{
+    std::size_t size = 0;
+    for( const auto& message : messages )
+    {
+        if( !message ) return;
+        size += message->size();
+    }
+    if( messages.empty() || size > m_capacity ) return; // 容量を超えるものは保持しない
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto found = m_index.find( parameters );
+    if( found != m_index.end() )
+    {
+        m_size -= found->second->size;
+        m_entries.erase( found->second );
+        m_index.erase( found );
+    }
+
+    m_entries.push_front( { parameters, std::move( messages ), size } );
+    m_index.emplace( parameters, m_entries.begin() );
+    m_size += size;
+    evict();
+}
+
+std::size_t ResultCache::size() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_size;
+}
+
+std::size_t ResultCache::numberOfHits() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_number_of_hits;
+}
+
+std::size_t ResultCache::numberOfMisses() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_number_of_misses;
+}
+
+void ResultCache::evict()
+{
+    while( m_size > m_capacity && !m_entries.empty() )
+    {
+        const Entry& last = m_entries.back();
+        m_size -= last.size;
+        m_index.erase( last.parameters );
+        m_entries.pop_back();
+    }
+}
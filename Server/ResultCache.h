@@ -0,0 +1,48 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include "SamplingParameters.h"
+#include "SharedBuffer.h"
+
+// サンプリングパラメータをキーに、シリアライズ済みの送信メッセージ列を保持する LRU キャッシュ
+// 容量はメッセージの合計バイト数で管理する
+// 複数のイベントループスレッドとワーカースレッドから呼ばれるため、内部でロックする
+class ResultCache
+{
+public:
+    explicit ResultCache( std::size_t capacityInBytes );
+
+    SharedBufferList find( const SamplingParameters& parameters ); // 無ければ空を返す
+    void insert( const SamplingParameters& parameters, SharedBufferList messages );
+
+    std::size_t capacity() const { return m_capacity; }
+    std::size_t size() const;
+    std::size_t numberOfHits() const;
+    std::size_t numberOfMisses() const;
+
+private:
+    struct Entry
+    {
+        SamplingParameters parameters;
+        SharedBufferList messages;
+        std::size_t size;
+    };
+
+    void evict(); // m_mutex を取得した状態で呼ぶこと
+
+    const std::size_t m_capacity;
+    std::size_t m_size = 0;
+    std::size_t m_number_of_hits = 0;
+    std::size_t m_number_of_misses = 0;
+    std::list<Entry> m_entries; // 先頭ほど最近使われたもの
+    std::unordered_map<SamplingParameters, std::list<Entry>::iterator> m_index;
+    mutable std::mutex m_mutex;
+};
+
+#endif // RESULTCACHE_H
@@ -0,0 +1,103 @@
+#ifndef SAMPLINGPARAMETERS_H
+#define SAMPLINGPARAMETERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <kvs/TransferFunction>
+
+// サンプリング結果を一意に決めるパラメータの組
+// 結果キャッシュのキーとして使う
+struct SamplingParameters
+{
+    std::string volume_id = "hydrogen";
+    unsigned int dims[3] = { 32, 32, 32 };
+    std::size_t repeat = 4;            // number of repetitions
+    float step = 0.5f;                 // sampling step
+    std::uint64_t tfunc_hash = 0;      // 伝達関数のテーブルから計算したハッシュ
+    std::shared_ptr<const std::vector<unsigned char>> tfunc_data; // 伝達関数のテーブルと値域 (ハッシュが一致したときに内容を比べる)
+    std::uint64_t seed = 0;            // 乱数のシード
+    bool chunked = false;              // サンプリング途中の粒子をチャンクに分けて逐次送るか
+    int coord_bits = 0;                // 座標の量子化ビット数 (0: float32 のまま送る)
+    int normal_encoding = 0;           // 法線の符号化 (OctahedralNormal::Encoding)
+
+    bool operator==( const SamplingParameters& other ) const
+    {
+        return volume_id == other.volume_id &&
+               dims[0] == other.dims[0] && dims[1] == other.dims[1] && dims[2] == other.dims[2] &&
+               repeat == other.repeat &&
+               step == other.step &&
+               tfunc_hash == other.tfunc_hash &&
+               sameTransferFunction( other ) &&
+               seed == other.seed &&
+               chunked == other.chunked &&
+               coord_bits == other.coord_bits &&
+               normal_encoding == other.normal_encoding;
+    }
+
+    std::size_t hash() const
+    {
+        std::uint64_t h = fnv1a( volume_id.data(), volume_id.size() );
+        h = fnv1a( dims, sizeof( dims ), h );
+        h = fnv1a( &repeat, sizeof( repeat ), h );
+        h = fnv1a( &step, sizeof( step ), h );
+        h = fnv1a( &tfunc_hash, sizeof( tfunc_hash ), h );
+        h = fnv1a( &seed, sizeof( seed ), h );
+        h = fnv1a( &chunked, sizeof( chunked ), h );
+        h = fnv1a( &coord_bits, sizeof( coord_bits ), h );
+        h = fnv1a( &normal_encoding, sizeof( normal_encoding ), h );
+        return static_cast<std::size_t>( h );
+    }
+
+    // FNV-1a (64bit)
+    static std::uint64_t fnv1a( const void* data, std::size_t size, std::uint64_t h = 14695981039346656037ull )
+    {
+        const auto* bytes = static_cast<const unsigned char*>( data );
+        for( std::size_t i = 0; i < size; ++i )
+        {
+            h ^= bytes[i];
+            h *= 1099511628211ull;
+        }
+        return h;
+    }
+
+    // カラーマップ・不透明度マップのテーブルと値域を tfunc_data に写し、そのハッシュを tfunc_hash に設定する
+    // (64bit のハッシュは衝突しうるので、キーの比較では tfunc_data の内容まで比べる)
+    void setTransferFunction( const kvs::TransferFunction& tfunc )
+    {
+        const auto& colors = tfunc.colorMap().table();
+        const auto& opacities = tfunc.opacityMap().table();
+        const float range[2] = { tfunc.hasRange() ? tfunc.minValue() : 0.0f, tfunc.hasRange() ? tfunc.maxValue() : 0.0f };
+        const unsigned char hasRange = tfunc.hasRange() ? 1 : 0;
+
+        auto data = std::make_shared<std::vector<unsigned char>>( colors.byteSize() + opacities.byteSize() + sizeof( range ) + 1 );
+        unsigned char* p = data->data();
+        std::memcpy( p, colors.data(), colors.byteSize() ); p += colors.byteSize();
+        std::memcpy( p, opacities.data(), opacities.byteSize() ); p += opacities.byteSize();
+        std::memcpy( p, range, sizeof( range ) ); p += sizeof( range );
+        *p = hasRange;
+
+        tfunc_hash = fnv1a( data->data(), data->size() );
+        tfunc_data = std::move( data );
+    }
+
+    bool sameTransferFunction( const SamplingParameters& other ) const
+    {
+        if( tfunc_data == other.tfunc_data ) return true; // 同じ要求から写したもの (または両方とも未設定)
+        if( !tfunc_data || !other.tfunc_data ) return false;
+        return *tfunc_data == *other.tfunc_data;
+    }
+};
+
+template <>
+struct std::hash<SamplingParameters>
+{
+    std::size_t operator()( const SamplingParameters& parameters ) const { return parameters.hash(); }
+};
+
+#endif // SAMPLINGPARAMETERS_H
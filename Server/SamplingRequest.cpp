@@ -0,0 +1,84 @@
+#include "SamplingRequest.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <kvs/ColorMap>
+#include <kvs/OpacityMap>
+
+#include "../Shared/CoordinateQuantization.h"
+#include "../Shared/OctahedralNormal.h"
+#include "ParallelCellByCellSampling.h"
+
+namespace
+{
+
+bool Fail( std::string* error, const std::string& message )
+{
+    if( error ) *error = message;
+    return false;
+}
+
+} // end of namespace
+
+bool SamplingRequest::validate( std::string* error ) const
+{
+    if( parameters.repeat < 1 || parameters.repeat > MaxRepeat ) return Fail( error, "repeat out of range" );
+    if( !std::isfinite( parameters.step ) || parameters.step < MinStep || parameters.step > MaxStep ) return Fail( error, "step out of range" );
+    if( parameters.coord_bits != 0 && !CoordinateQuantization::IsValidBits( parameters.coord_bits ) ) return Fail( error, "coord_bits out of range" );
+    if( !OctahedralNormal::IsValidEncoding( parameters.normal_encoding ) ) return Fail( error, "normal_encoding out of range" );
+
+    if( !opacities.empty() )
+    {
+        if( opacities.size() < MinTransferFunctionResolution || opacities.size() > MaxTransferFunctionResolution ) return Fail( error, "transfer_function resolution out of range" );
+        if( colors.size() != opacities.size() * 3 ) return Fail( error, "transfer_function size mismatch" );
+        for( kvs::Real32 opacity : opacities )
+        {
+            if( !std::isfinite( opacity ) || opacity < 0.0f || opacity > 1.0f ) return Fail( error, "transfer_function.opacities must be 0-1" );
+        }
+    }
+    else if( !colors.empty() )
+    {
+        return Fail( error, "transfer_function size mismatch" );
+    }
+
+    return true;
+}
+
+// validate() を通った要求について、要求の解像度 (生成するボリュームの解像度) を確かめる
+bool SamplingRequest::validateResolution( std::string* error ) const
+{
+    for( unsigned int n : parameters.dims )
+    {
+        if( n < MinResolution || n > MaxResolution ) return Fail( error, "resolution out of range" );
+    }
+
+    const kvs::Vec3ui resolution( parameters.dims[0], parameters.dims[1], parameters.dims[2] );
+    return ValidateCost( resolution, parameters, this->transferFunction(), error );
+}
+
+bool SamplingRequest::ValidateCost( const kvs::Vec3ui& resolution, const SamplingParameters& parameters, const kvs::TransferFunction& tfunc, std::string* error )
+{
+    std::size_t cells = 1;
+    for( int i = 0; i < 3; ++i ) cells *= resolution[i] > 0 ? resolution[i] - 1 : 0;
+    if( cells * parameters.repeat > MaxCellRepetitions ) return Fail( error, "resolution x repeat exceeds the limit" );
+
+    // 出力の粒子数を最大の不透明度で見積もる
+    float maxOpacity = 0.0f;
+    const auto& table = tfunc.opacityMap().table();
+    for( std::size_t i = 0; i < table.size(); ++i ) maxOpacity = std::max( maxOpacity, table[i] );
+    const double particles = static_cast<double>( cells ) * static_cast<double>( parameters.repeat ) *
+                             ParallelCellByCellSampling::ParticleDensity( maxOpacity, parameters.step );
+    if( particles > MaxEstimatedParticles ) return Fail( error, "estimated number of particles exceeds the limit (increase step or decrease resolution/repeat)" );
+
+    return true;
+}
+
+kvs::TransferFunction SamplingRequest::transferFunction() const
+{
+    if( opacities.empty() ) return kvs::TransferFunction( 256 );
+
+    const kvs::ColorMap colorMap( kvs::ColorMap::Table( colors.data(), colors.size() ) );
+    const kvs::OpacityMap opacityMap( kvs::OpacityMap::Table( opacities.data(), opacities.size() ) );
+    return kvs::TransferFunction( colorMap, opacityMap );
+}
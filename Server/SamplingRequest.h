@@ -0,0 +1,47 @@
+#ifndef SAMPLINGREQUEST_H
+#define SAMPLINGREQUEST_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <kvs/TransferFunction>
+#include <kvs/Type>
+#include <kvs/Vector3>
+
+#include "SamplingParameters.h"
+
+// クライアントの "request" メッセージで指定されたサンプリング条件
+// 値はクライアントから送られてくる (ClientMessage が取り出す) ので、validate() で範囲を確かめてから使う
+// 解像度に関わる上限は validateResolution() で確かめる (ファイルのボリュームは要求の解像度を使わないので、
+// 読み込んだボリュームの解像度を ValidateCost() に渡して確かめ直す)
+struct SamplingRequest
+{
+    // 受け付ける値の範囲
+    // サンプリングのコストはおおよそ セル数 × repeat に比例するので、その積にも上限を設ける
+    static constexpr unsigned int MinResolution = 2;
+    static constexpr unsigned int MaxResolution = 256;
+    static constexpr std::size_t MaxRepeat = 64;
+    static constexpr std::size_t MaxCellRepetitions = std::size_t( 256 ) * 256 * 256 * 4;
+    static constexpr float MinStep = 0.05f;
+    static constexpr float MaxStep = 16.0f;
+    static constexpr std::size_t MinTransferFunctionResolution = 2;
+    static constexpr std::size_t MaxTransferFunctionResolution = 4096;
+    // 粒子数の見積もり (全セルが伝達関数の最大の不透明度だった場合の セル数 × repeat × 粒子密度) の上限
+    // 粒子密度は step の 3 乗に反比例するので、セル数 × repeat だけでは出力の大きさを抑えられない
+    // (1 粒子あたりサンプラ内で 27 バイト。64M 粒子で約 1.7 GiB)
+    static constexpr double MaxEstimatedParticles = 64.0 * 1024 * 1024;
+
+    SamplingParameters parameters;    // tfunc_hash / tfunc_data は transferFunction() の結果から設定する
+    std::vector<kvs::UInt8> colors;   // カラーマップ (RGB × 解像度)。空であれば既定の伝達関数を使う
+    std::vector<kvs::Real32> opacities; // 不透明度マップ (解像度)
+
+    bool validate( std::string* error ) const;
+    bool validateResolution( std::string* error ) const;
+    kvs::TransferFunction transferFunction() const;
+
+    // 解像度 resolution のボリュームを parameters / tfunc でサンプリングするコストが上限に収まるか
+    static bool ValidateCost( const kvs::Vec3ui& resolution, const SamplingParameters& parameters, const kvs::TransferFunction& tfunc, std::string* error );
+};
+
+#endif // SAMPLINGREQUEST_H
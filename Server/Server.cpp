@@ -1,115 +1,594 @@
 #include "Server.h"
 
-Server::Server( int port )
+#include <algorithm>
+#include <iterator>
+
+#include "../Shared/Trace.h"
+#include "Logger.h"
+
+namespace
+{
+
+// ソケットの未送信バイト数がこれを下回っている間だけ、送信キューから次のメッセージを送る
+const unsigned int SendHighWaterMark = 4 * 1024 * 1024; // 4 MiB
+
+// 送信キューに溜められる上限 (超えた場合は受信が追いつかないクライアントとして切断する)
+// 最大のチャンク (1M 粒子、約 27 MiB) 2 つ分にとどめ、止まったクライアントが抱えるメモリを抑える
+// 分割せずに送る結果はこれより大きくなりうるので、キューが空のときの 1 メッセージは大きさによらず受け付ける
+const std::size_t SendQueueLimit = 64 * 1024 * 1024; // 64 MiB
+
+// 受信するメッセージの大きさの上限 (uWS の既定は 16 KiB で、超えるとエラーを返さずに切断される)
+// 最大解像度の伝達関数を含む要求が収まるようにする (JSON で 1 エントリ 64 バイトあれば足りる)
+const unsigned int MaxReceivedMessageLength = 1024 * 1024; // 1 MiB
+static_assert( SamplingRequest::MaxTransferFunctionResolution * 64 <= MaxReceivedMessageLength, "a valid request must fit in a message" );
+
+// チャットのルーム名の長さの上限
+const std::size_t MaxRoomNameLength = 64;
+const char* const DefaultRoom = "lobby";
+
+const ControlEncoding::Encoding ControlEncodings[] = { ControlEncoding::Json, ControlEncoding::MessagePack, ControlEncoding::Cbor };
+
+// 符号化済みのチャットメッセージ (トピックごと)
+struct EncodedChat
+{
+    std::string topic;
+    std::vector<char> message;
+    uWS::OpCode opCode;
+};
+
+} // end of namespace
+
+Server::Server( int port, unsigned int numberOfThreads, const std::map<std::string, std::string>& volumeFiles )
     : m_port( port )
+    , m_number_of_threads( std::max( numberOfThreads, 1u ) )
+    , m_result_cache( 512 * 1024 * 1024 ) // 512 MiB
+    , m_volume_registry( std::size_t( 1024 ) * 1024 * 1024 ) // 1 GiB
 {
+    for( const auto& [id, filename] : volumeFiles )
+    {
+        m_volume_registry.registerFile( id, filename );
+        SERVER_LOG( Info ) << "[Server] Volume \"" << id << "\": " << filename;
+    }
     initialize();
 }
 
 void Server::initialize()
 {
-    m_u_web_sockets.ws<ClientSession>( "/*",
-                                      {
-                                          .open = [this]( uWS::WebSocket<false, true, ClientSession>* ws )
-                                          {
-                                              this->onOpen( ws );
-                                          },
-                                          .message = [this]( uWS::WebSocket<false, true, ClientSession>* ws, std::string_view message, uWS::OpCode opCode )
-                                          {
-                                              this->onMessage( ws, message, opCode );
-                                          },
-                                          .drain = [](uWS::WebSocket<false, true, ClientSession>* ws)
-                                          {
-                                              // 未送信バイト数を取得して表示
-                                              size_t remaining = ws->getBufferedAmount();
-                                              std::cout << "[Server] Remaining bytes to send: " << remaining << std::endl;
-                                          },
-                                          .close = [this]( uWS::WebSocket<false, true, ClientSession>* ws, int code, std::string_view msg )
-                                          {
-                                              this->onClose( ws, code, msg );
-                                          }
-                                      } );
-
-    m_u_web_sockets.listen( m_port, [this]( auto* token )
-                           {
-                               if( token )
-                                   std::cout << "[Server] Listening on port " << m_port << std::endl;
-                               else
-                                   std::cerr << "[Server] Failed to listen on port " << m_port << std::endl;
-                           } ).run();
+    // スレッドごとに uWS::App (イベントループ) を持ち、同じポートで listen する
+    // uSockets は既定で SO_REUSEPORT を付けるので、Linux ではカーネルが接続を各スレッドに振り分ける
+    // (Windows など SO_REUSEPORT が無い環境では 1 スレッドで使うこと)
+    // 先頭のイベントループは呼び出し元スレッドで実行する
+    for( unsigned int i = 1; i < m_number_of_threads; ++i )
+    {
+        m_event_loop_threads.emplace_back( [this, i]() { this->runEventLoop( i ); } );
+    }
+    this->runEventLoop( 0 );
+
+    for( auto& thread : m_event_loop_threads )
+    {
+        if( thread.joinable() ) thread.join();
+    }
+}
+
+void Server::runEventLoop( unsigned int threadIndex )
+{
+    // uWS::App は生成したスレッドのループに属するため、実行するスレッド上で生成する
+    uWS::App u_web_sockets;
+    Trace::SetThreadName( "event loop " + std::to_string( threadIndex ) );
+
+    // 監視用 (どのスレッドの App に届いても、全スレッド分を合計して返す)
+    u_web_sockets.get( "/metrics", [this]( auto* res, auto* /*req*/ )
+                      {
+                          res->writeHeader( "Content-Type", "text/plain; version=0.0.4" )->end( this->renderMetrics() );
+                      } );
+
+    // 要求の処理区間 (Chrome のトレース形式。chrome://tracing や Perfetto で開く)
+    u_web_sockets.get( "/trace", []( auto* res, auto* /*req*/ )
+                      {
+                          res->writeHeader( "Content-Type", "application/json" )->end( Trace::Dump() );
+                      } );
+
+    u_web_sockets.ws<ClientSession>( "/*",
+                                    {
+                                        .maxPayloadLength = MaxReceivedMessageLength,
+                                        // 送信は送信キューで SendHighWaterMark 以下に抑えるので、uWS 側で破棄されないようにする
+                                        .maxBackpressure = SendHighWaterMark,
+                                        .open = [this]( uWS::WebSocket<false, true, ClientSession>* ws )
+                                        {
+                                            this->onOpen( ws );
+                                        },
+                                        .message = [this]( uWS::WebSocket<false, true, ClientSession>* ws, std::string_view message, uWS::OpCode opCode )
+                                        {
+                                            this->onMessage( ws, message, opCode );
+                                        },
+                                        .drain = [this]( uWS::WebSocket<false, true, ClientSession>* ws )
+                                        {
+                                            this->onDrain( ws );
+                                        },
+                                        .close = [this]( uWS::WebSocket<false, true, ClientSession>* ws, int code, std::string_view msg )
+                                        {
+                                            this->onClose( ws, code, msg );
+                                        }
+                                    } );
+
+    {
+        std::lock_guard<std::mutex> lock( m_event_loops_mutex );
+        m_event_loops.push_back( { uWS::Loop::get(), &u_web_sockets } );
+    }
+
+    u_web_sockets.listen( m_port, [this, threadIndex]( auto* token )
+                         {
+                             if( token )
+                             {
+                                 SERVER_LOG( Info ) << "[Server] Listening on port " << m_port << " (thread " << threadIndex << ")";
+                             }
+                             else
+                             {
+                                 SERVER_LOG( Error ) << "[Server] Failed to listen on port " << m_port << " (thread " << threadIndex << ")";
+                             }
+                         } ).run();
+
+    std::lock_guard<std::mutex> lock( m_event_loops_mutex );
+    m_event_loops.erase( std::remove_if( m_event_loops.begin(), m_event_loops.end(), [&u_web_sockets]( const EventLoop& e ) { return e.app == &u_web_sockets; } ), m_event_loops.end() );
+}
+
+// サンプリングしながら、完成したブロックを assembler に渡して粒子メッセージ (ParticleWireFormat) にする
+// ブロックは送信バッファの各セクションへ直接書き込まれ、kvs::PointObject や中間のバッファを経由しない
+// ワーカースレッドから呼ばれるため、Server のメンバには触れない (計測値は metrics に記録する)
+// 並列サンプリングのブロックは、呼び出し元のワーカースレッドと pool の空いているスレッドで処理する (スレッドは生成しない)
+// 途中で取り消された場合・サンプリングできなかった場合は finish() せずに false を返す (後者は error に理由を入れる)
+bool Server::createParticleMessages( const kvs::StructuredVolumeObject& volume, const SamplingParameters& parameters, const kvs::TransferFunction& tfunc, ParticleChunkAssembler& assembler, const std::atomic<bool>* cancelled, Metrics& metrics, WorkerPool& pool, std::string* error )
+{
+    if( ParallelCellByCellSampling::isSupported( volume ) )
+    {
+        ParallelCellByCellSampling sampler( parameters.repeat, parameters.step, tfunc, parameters.seed, static_cast<unsigned int>( pool.numberOfThreads() ), &pool );
+        // まとめて送る場合は粒子数を先に数えてメッセージを確保し、ブロックを溜めずに書き込む
+        ParallelCellByCellSampling::CountCallback counted;
+        if( !parameters.chunked ) counted = [&assembler]( const std::vector<std::size_t>& blockVertices ) { assembler.reserve( blockVertices ); };
+        const bool completed = sampler.sample( volume, [&assembler, &metrics]( std::size_t blockIndex, ParallelCellByCellSampling::Block&& block )
+                                              {
+                                                  Trace::Scope trace( "server", "serialize" );
+                                                  const auto start = Metrics::Clock::now();
+                                                  assembler.add( blockIndex, std::move( block ) );
+                                                  metrics.observeSince( Metrics::SerializationSeconds, start );
+                                              }, cancelled, counted );
+        if( !completed )
+        {
+            // 取り消されていなければ、このサンプラで扱えないボリューム (値の型・解像度)
+            if( !IsCancelled( cancelled ) ) *error = "sampling failed: unsupported volume";
+            return false;
+        }
+    }
+    else
+    {
+        // KVS のサンプラは途中経過を取り出せないので、全体を 1 ブロックとして渡す
+        // (まとめて送る場合は、出力の配列からメッセージへ直接書き込む)
+        Trace::Scope trace( "server", "kvs sampling" );
+        std::unique_ptr<kvs::PointObject> object( new kvs::CellByCellMetropolisSampling( &volume, parameters.repeat, parameters.step, tfunc ) );
+        if( IsCancelled( cancelled ) ) return false;
+        Trace::Scope serialize( "server", "serialize" );
+        const auto start = Metrics::Clock::now();
+        const std::size_t numberOfVertices = object->numberOfVertices();
+        if( !parameters.chunked ) assembler.reserve( { numberOfVertices } );
+        assembler.add( 0, object->coords().data(), object->colors().data(), object->normals().data(), numberOfVertices );
+        object.reset();
+        metrics.observeSince( Metrics::SerializationSeconds, start );
+    }
+    Trace::Scope trace( "server", "serialize finish" );
+    const auto start = Metrics::Clock::now();
+    assembler.finish();
+    metrics.observeSince( Metrics::SerializationSeconds, start );
+    return true;
+}
+
+void Server::sendMessages( uWS::WebSocket<false, true, ClientSession>* ws, const SharedBufferList& messages, std::uint32_t requestId )
+{
+    for( const auto& message : messages )
+    {
+        if( !enqueue( ws, message, uWS::OpCode::BINARY, requestId ) ) return;
+    }
+}
+
+// 送信キューに追加して、送れる分だけ送る
+// 上限を超えた場合はソケットを閉じて false を返す (以降 ws に触れてはいけない)
+bool Server::enqueue( uWS::WebSocket<false, true, ClientSession>* ws, SharedBuffer message, uWS::OpCode opCode, std::uint32_t requestId )
+{
+    ClientSession* session = ws->getUserData();
+    if( !session->send_queue.empty() && session->queued_bytes + message->size() > SendQueueLimit )
+    {
+        SERVER_LOG( Warning ) << "[Server] Send queue limit exceeded (" << session->queued_bytes << " bytes queued), closing slow consumer";
+        ws->end( 1013, "slow consumer" );
+        return false;
+    }
+
+    session->queued_bytes += message->size();
+    m_metrics.add( Metrics::QueuedBytes, static_cast<std::int64_t>( message->size() ) );
+    session->send_queue.push_back( { std::move( message ), opCode, requestId, Metrics::Clock::now() } );
+    flush( ws );
+    return true;
+}
+
+void Server::flush( uWS::WebSocket<false, true, ClientSession>* ws )
+{
+    ClientSession* session = ws->getUserData();
+    if( !session->send_queue.empty() )
+    {
+        Trace::Scope trace( "server", "send" );
+        while( !session->send_queue.empty() && ws->getBufferedAmount() < SendHighWaterMark )
+        {
+            QueuedMessage queued = std::move( session->send_queue.front() );
+            session->send_queue.pop_front();
+            session->queued_bytes -= queued.message->size();
+            ws->send( std::string_view( queued.message->data(), queued.message->size() ), queued.opCode );
+
+            const std::int64_t size = static_cast<std::int64_t>( queued.message->size() );
+            m_metrics.add( Metrics::QueuedBytes, -size );
+            m_metrics.increment( Metrics::MessagesSent );
+            m_metrics.increment( Metrics::BytesSent, static_cast<std::uint64_t>( size ) );
+            m_metrics.observeSince( Metrics::SendQueueSeconds, queued.enqueued_at );
+        }
+    }
+
+    // uWS が保持している未送信バイト数は、ソケットごとに前回観測した値との差分で合計に反映する
+    const std::size_t buffered = ws->getBufferedAmount();
+    m_metrics.add( Metrics::BufferedBytes, static_cast<std::int64_t>( buffered ) - static_cast<std::int64_t>( session->buffered_amount ) );
+    session->buffered_amount = buffered;
+}
+
+std::string Server::chatTopic( const std::string& room, ControlEncoding::Encoding encoding )
+{
+    return "chat/" + room + "/" + ControlEncoding::Name( encoding );
+}
+
+// ルームのトピックを購読し直す (ルームまたは符号化が変わったとき)
+// ソケットは自スレッドの App のトピックだけを購読する。他スレッドへの配信は publishChat で行う
+void Server::subscribeChat( uWS::WebSocket<false, true, ClientSession>* ws, const std::string& room, ControlEncoding::Encoding encoding )
+{
+    ClientSession* session = ws->getUserData();
+    if( !session->room.empty() ) ws->unsubscribe( chatTopic( session->room, session->control_encoding ) );
+    session->room = room;
+    session->control_encoding = encoding;
+    ws->subscribe( chatTopic( session->room, session->control_encoding ) );
+}
+
+// チャットは符号化ごとに 1 回だけシリアライズし、各スレッドの App に publish する
+// 購読者への送信は uWS が行う (送信キューは経由しないので、未送信バイト数が maxBackpressure を超えた購読者には届かない)
+void Server::publishChat( const std::string& room, const std::string& chat )
+{
+    auto encoded = std::make_shared<std::vector<EncodedChat>>();
+    for( ControlEncoding::Encoding encoding : ControlEncodings )
+    {
+        encoded->push_back( {
+            chatTopic( room, encoding ),
+            ControlEncoding::EncodeStringMap( { { "type", "chat" }, { "room", room }, { "chat_message", chat } }, encoding ),
+            ControlEncoding::IsBinary( encoding ) ? uWS::OpCode::BINARY : uWS::OpCode::TEXT } );
+    }
+
+    m_metrics.increment( Metrics::ChatMessages );
+    uWS::Loop* current = uWS::Loop::get();
+    std::lock_guard<std::mutex> lock( m_event_loops_mutex );
+    for( const EventLoop& eventLoop : m_event_loops )
+    {
+        auto publish = [app = eventLoop.app, encoded]()
+        {
+            for( const EncodedChat& chat : *encoded )
+            {
+                app->publish( chat.topic, std::string_view( chat.message.data(), chat.message.size() ), chat.opCode );
+            }
+        };
+        if( eventLoop.loop == current ) publish(); // 自スレッドの App はその場で publish する
+        else eventLoop.loop->defer( std::move( publish ) );
+    }
+}
+
+// 文字列だけからなる制御メッセージを、ソケットでネゴシエーションされた符号化で送る
+void Server::sendControlMessage( uWS::WebSocket<false, true, ClientSession>* ws, std::initializer_list<std::pair<std::string_view, std::string_view>> entries )
+{
+    const ControlEncoding::Encoding encoding = ws->getUserData()->control_encoding;
+    auto message = std::make_shared<const std::vector<char>>( ControlEncoding::EncodeStringMap( entries, encoding ) );
+    enqueue( ws, std::move( message ), ControlEncoding::IsBinary( encoding ) ? uWS::OpCode::BINARY : uWS::OpCode::TEXT );
+}
+
+// クライアントに処理できなかった要求を伝える
+void Server::sendError( uWS::WebSocket<false, true, ClientSession>* ws, const std::string& message )
+{
+    SERVER_LOG( Warning ) << message;
+    sendControlMessage( ws, { { "type", "error" }, { "error_message", message } } );
+}
+
+// /metrics の応答 (Metrics の値に、キャッシュなどが持っている値を加える)
+std::string Server::renderMetrics() const
+{
+    std::string out = m_metrics.render();
+    Metrics::AppendCounter( out, "kvs_server_cache_hits_total", "Result cache lookups that hit.", static_cast<double>( m_result_cache.numberOfHits() ) );
+    Metrics::AppendCounter( out, "kvs_server_cache_misses_total", "Result cache lookups that missed.", static_cast<double>( m_result_cache.numberOfMisses() ) );
+    Metrics::AppendGauge( out, "kvs_server_cache_bytes", "Bytes held by the result cache.", static_cast<double>( m_result_cache.size() ) );
+    Metrics::AppendGauge( out, "kvs_server_cache_capacity_bytes", "Capacity of the result cache.", static_cast<double>( m_result_cache.capacity() ) );
+    Metrics::AppendGauge( out, "kvs_server_samplings_in_progress", "Samplings currently running or waiting for a worker.", static_cast<double>( m_single_flight.numberOfFlights() ) );
+    Metrics::AppendGauge( out, "kvs_server_pending_jobs", "Jobs waiting for a worker thread.", static_cast<double>( m_worker_pool.numberOfPendingJobs() ) );
+    Metrics::AppendGauge( out, "kvs_server_worker_threads", "Worker threads.", static_cast<double>( m_worker_pool.numberOfThreads() ) );
+    Metrics::AppendGauge( out, "kvs_server_event_loop_threads", "Event loop threads.", static_cast<double>( m_number_of_threads ) );
+    Metrics::AppendGauge( out, "kvs_server_volumes", "Volumes resident in the registry.", static_cast<double>( m_volume_registry.numberOfVolumes() ) );
+    Metrics::AppendGauge( out, "kvs_server_volume_bytes", "Bytes of volume values resident in the registry.", static_cast<double>( m_volume_registry.size() ) );
+    Metrics::AppendGauge( out, "kvs_server_volume_capacity_bytes", "Capacity of the volume registry.", static_cast<double>( m_volume_registry.capacity() ) );
+    return out;
+}
+
+// 処理中の要求をすべて取り消し、送信キューに残っているそれらの粒子メッセージを捨てる
+// (制御メッセージは残す。uWS に渡し済みの分は送られる)
+void Server::cancelRequests( uWS::WebSocket<false, true, ClientSession>* ws )
+{
+    ClientSession* session = ws->getUserData();
+    for( auto& [requestId, request] : session->in_flight )
+    {
+        request.token->store( true );
+        request.ticket.flight->leave( request.ticket.listener_id ); // 他に待っている要求がなければ計算も止まる
+    }
+    session->in_flight.clear();
+
+    auto& queue = session->send_queue;
+    queue.erase( std::remove_if( queue.begin(), queue.end(), [this, session]( const QueuedMessage& queued )
+                                {
+                                    if( queued.request_id == 0 ) return false;
+                                    session->queued_bytes -= queued.message->size();
+                                    m_metrics.add( Metrics::QueuedBytes, -static_cast<std::int64_t>( queued.message->size() ) );
+                                    return true;
+                                } ), queue.end() );
 }
 
 void Server::onOpen( uWS::WebSocket<false, true, ClientSession>* ws )
 {
-    std::cout << __func__ << std::endl;
+    SERVER_LOG( Debug ) << __func__;
+    m_metrics.increment( Metrics::ConnectionsOpened );
+}
+
+void Server::onDrain( uWS::WebSocket<false, true, ClientSession>* ws )
+{
+    // 未送信バイト数が減ったので、送信キューの続きを送る
+    flush( ws );
 }
 
 void Server::onClose( uWS::WebSocket<false, true, ClientSession>* ws, int, std::string_view )
 {
-    std::cout << __func__ << std::endl;
-}
-
-void Server::onMessage( uWS::WebSocket<false, true, ClientSession>* ws, std::string_view message, uWS::OpCode )
-{
-    std::cout << __func__ << std::endl;
-    nlohmann::json received;
-    received = nlohmann::json::parse(message);
-
-    if (received.contains("type") && received["type"].get<std::string>() == "request")
-    {
-        auto* volume = new kvs::HydrogenVolumeData( { 32, 32, 32 } );
-        const auto repeat = 4; // number of repetitions
-        const auto step = 0.5f; // sampling step
-        const auto tfunc = kvs::TransferFunction( 256 ); // transfer function
-        auto* object = new kvs::CellByCellMetropolisSampling( volume, repeat, step, tfunc );
-        delete volume;
-
-        const size_t numberOfVertices = object->numberOfVertices();
-        const kvs::ValueArray<kvs::Real32>& coords = object->coords();
-        const kvs::ValueArray<kvs::UInt8>& colors = object->colors();
-        const kvs::ValueArray<kvs::Real32>& normals = object->normals();
-        const kvs::Vec3& minObjectCoords = object->minObjectCoord();
-        const kvs::Vec3& maxObjectCoords = object->maxObjectCoord();
-
-        size_t total_size =
-            sizeof( size_t ) +
-            sizeof( kvs::Real32 ) * 3 * numberOfVertices +
-            sizeof( kvs::UInt8 )  * 3 * numberOfVertices +
-            sizeof( kvs::Real32 ) * 3 * numberOfVertices +
-            sizeof( kvs::Real32 ) * 3 +
-            sizeof( kvs::Real32 ) * 3;
-
-        std::vector<char> buffer( total_size );
-        size_t offset = 0;
-        std::memcpy( buffer.data() + offset, &numberOfVertices, sizeof( size_t ) );
-        offset += sizeof( size_t );
-        std::memcpy( buffer.data() + offset, coords.data(), sizeof( kvs::Real32 ) * 3 * numberOfVertices );
-        offset += sizeof( kvs::Real32 ) * 3 * numberOfVertices;
-        std::memcpy( buffer.data() + offset, colors.data(), sizeof( kvs::UInt8 ) * 3 * numberOfVertices );
-        offset += sizeof( kvs::UInt8 ) * 3 * numberOfVertices;
-        std::memcpy( buffer.data() + offset, normals.data(), sizeof( kvs::Real32 ) * 3 * numberOfVertices );
-        offset += sizeof( kvs::Real32 ) * 3 * numberOfVertices;
-        std::memcpy( buffer.data() + offset, minObjectCoords.data(), sizeof( kvs::Real32 ) * 3 );
-        offset += sizeof( kvs::Real32 ) * 3;
-        std::memcpy( buffer.data() + offset, maxObjectCoords.data(), sizeof( kvs::Real32 ) * 3 );
-        offset += sizeof( kvs::Real32 ) * 3;
-
-        delete object;
-
-        ws->send( std::string_view( buffer.data(), buffer.size() ), uWS::OpCode::BINARY );
-    }
-    else if (received.contains("type") && received["type"].get<std::string>() == "chat")
-    {
-        if (received.contains("chat_message") && received["chat_message"].is_string()) {
-            std::string chat = received["chat_message"].get<std::string>();
-            nlohmann::json chat_message =
-                {
-                    { "type", "chat" },
-                    { "chat_message", chat }
-                };
-            ws->send(chat_message.dump(), uWS::OpCode::TEXT); // send は文字列に変換
-        } else {
-            std::cout << "[Warning] chat_message missing or invalid type" << std::endl;
+    SERVER_LOG( Debug ) << __func__;
+    cancelRequests( ws ); // ワーカースレッドの処理を止め、以降ソケットに触れさせない
+    ClientSession* session = ws->getUserData();
+    m_metrics.increment( Metrics::ConnectionsClosed );
+    m_metrics.add( Metrics::QueuedBytes, -static_cast<std::int64_t>( session->queued_bytes ) );
+    m_metrics.add( Metrics::BufferedBytes, -static_cast<std::int64_t>( session->buffered_amount ) );
+    session->send_queue.clear();
+    session->queued_bytes = 0;
+    session->buffered_amount = 0;
+}
+
+void Server::onMessage( uWS::WebSocket<false, true, ClientSession>* ws, std::string_view message, uWS::OpCode opCode )
+{
+    SERVER_LOG( Debug ) << __func__;
+    Trace::Scope trace( "server", "onMessage" );
+    m_metrics.increment( Metrics::MessagesReceived );
+    ClientSession* session = ws->getUserData();
+
+    // テキストフレームは常に JSON、バイナリフレームはネゴシエーションされた符号化で読む
+    const ControlEncoding::Encoding encoding = ( opCode == uWS::OpCode::TEXT ) ? ControlEncoding::Json : session->control_encoding;
+    if( opCode != uWS::OpCode::TEXT && !ControlEncoding::IsBinary( encoding ) )
+    {
+        sendError( ws, "binary control message without negotiation" );
+        return;
+    }
+
+    // DOM は作らず、必要なフィールドだけを型付きで取り出す (不正な入力でも例外は投げない)
+    ClientMessage received;
+    std::string error;
+    bool parsed;
+    {
+        Trace::Scope parse( "server", "parse" );
+        parsed = received.parse( message, encoding, &error );
+    }
+    if( !parsed )
+    {
+        sendError( ws, "invalid message: " + error );
+        return;
+    }
+
+    if( received.type == ClientMessage::Request )
+    {
+        const auto accepted = Metrics::Clock::now();
+        const SamplingRequest& request = received.request;
+        // ファイルのボリュームは解像度がファイルで決まるので、要求の解像度ではなく読み込んだ後に確かめる
+        const bool generated = VolumeRegistry::IsGenerated( request.parameters.volume_id );
+        if( !request.validate( &error ) || ( generated && !request.validateResolution( &error ) ) )
+        {
+            m_metrics.increment( Metrics::RejectedRequests );
+            sendError( ws, "invalid request: " + error );
+            return;
+        }
+        if( !m_volume_registry.contains( request.parameters.volume_id ) )
+        {
+            m_metrics.increment( Metrics::RejectedRequests );
+            sendError( ws, "unknown volume: " + request.parameters.volume_id );
+            return;
+        }
+        m_metrics.increment( Metrics::Requests );
+
+        SamplingParameters parameters = request.parameters;
+        const kvs::TransferFunction tfunc = request.transferFunction();
+        parameters.setTransferFunction( tfunc );
+        if( !generated )
+        {
+            // 使わない解像度でキャッシュや計算の共有が分かれないよう、キーから外す
+            std::fill( std::begin( parameters.dims ), std::end( parameters.dims ), 0u );
+        }
+
+        // 同じパラメータの要求が処理中であれば、そのまま結果を待つ (スライダーの連打など)
+        if( !session->in_flight.empty() && session->has_last_parameters && session->last_parameters == parameters ) return;
+
+        // 新しい要求は古い要求を置き換える (古い要求の処理は止め、未送信の粒子メッセージは捨てる)
+        cancelRequests( ws );
+        const std::uint32_t requestId = session->next_request_id++;
+        trace.setId( requestId );
+        session->last_parameters = parameters;
+        session->has_last_parameters = true;
+
+        // 同じパラメータの結果がキャッシュにあれば、サンプラを使わずにそのまま送る
+        SharedBufferList cached;
+        {
+            Trace::Scope lookup( "server", "cache lookup", requestId );
+            cached = m_result_cache.find( parameters );
+        }
+        if( !cached.empty() )
+        {
+            m_metrics.increment( Metrics::CacheHitRequests );
+            sendMessages( ws, cached, requestId );
+            m_metrics.observeSince( Metrics::RequestSeconds, accepted );
+            return;
+        }
+
+        // 同じパラメータの計算が進行中であればそれに加わり、出来上がったメッセージを共有する
+        // メッセージはワーカースレッドから届くので、イベントループに戻して取り消されていないことを確かめてから送る
+        uWS::Loop* loop = uWS::Loop::get();
+        CancellationToken token = MakeCancellationToken();
+        SingleFlight::Listener listener;
+        listener.message = [this, ws, loop, token, requestId]( SharedBuffer message )
+        {
+            loop->defer( [this, ws, token, requestId, message]()
+                        {
+                            if( token->load() ) return; // 取り消された要求・切断されたソケットには送らない
+                            enqueue( ws, message, uWS::OpCode::BINARY, requestId );
+                        } );
+        };
+        listener.finished = [this, ws, loop, token, requestId, accepted]( bool completed, const std::string& error )
+        {
+            loop->defer( [this, ws, token, requestId, accepted, completed, error]()
+                        {
+                            if( token->load() ) return;
+                            ws->getUserData()->in_flight.erase( requestId ); // 処理中の要求から外す
+                            if( completed ) m_metrics.observeSince( Metrics::RequestSeconds, accepted );
+                            else if( !error.empty() ) sendError( ws, error ); // 失敗した要求は、待たせたままにしない
+                        } );
+        };
+        SingleFlight::Ticket ticket = m_single_flight.join( parameters, std::move( listener ) );
+        session->in_flight.emplace( requestId, InFlightRequest{ token, ticket } );
+        if( !ticket.leader )
+        {
+            m_metrics.increment( Metrics::SharedRequests );
+            return;
         }
+        m_metrics.increment( Metrics::SampledRequests );
+
+        // 最初の要求だけがワーカースレッドでサンプリングする
+        m_worker_pool.submit( [this, flight = ticket.flight, tfunc, requestId]()
+                             {
+                                 Trace::Scope job( "server", "sampling job", requestId ); // ID は計算を始めた要求のもの
+                                 const SamplingParameters& parameters = flight->parameters();
+                                 if( IsCancelled( flight->cancelled() ) ) // 待っている間に全員が取り消した
+                                 {
+                                     m_metrics.increment( Metrics::CancelledSamplings );
+                                     flight->finish( false );
+                                     return;
+                                 }
+
+                                 const kvs::Vec3ui dims( parameters.dims[0], parameters.dims[1], parameters.dims[2] );
+                                 VolumeRegistry::Volume volume;
+                                 {
+                                     Trace::Scope trace( "server", "volume", requestId );
+                                     volume = m_volume_registry.acquire( parameters.volume_id, dims );
+                                 }
+                                 if( !volume )
+                                 {
+                                     SERVER_LOG( Error ) << "[Server] Failed to acquire volume: " << parameters.volume_id;
+                                     m_metrics.increment( Metrics::FailedSamplings );
+                                     flight->finish( false, "failed to load volume: " + parameters.volume_id );
+                                     return;
+                                 }
+
+                                 // 実際の解像度でサンプリングのコストを確かめる (ファイルのボリュームは要求の時点では確かめていない)
+                                 std::string rejected;
+                                 if( !SamplingRequest::ValidateCost( volume->resolution(), parameters, tfunc, &rejected ) )
+                                 {
+                                     SERVER_LOG( Warning ) << "[Server] Rejected sampling of " << parameters.volume_id << ": " << rejected;
+                                     m_metrics.increment( Metrics::FailedSamplings );
+                                     volume.reset();
+                                     m_volume_registry.releaseUnused();
+                                     flight->finish( false, "invalid request: " + rejected );
+                                     return;
+                                 }
+
+                                 // メッセージは完成した順に、計算に加わっている全要求へ渡す (emit はチャンク番号順に呼ばれる)
+                                 // 送信バッファはそのままキャッシュと全要求の送信で共有する (uWS は送りきれなかった分だけを内部に保持する)
+                                 SharedBufferList messages;
+                                 ParticleChunkAssembler assembler( volume->minObjectCoord(), volume->maxObjectCoord(), parameters.coord_bits, parameters.normal_encoding, parameters.chunked, [&messages, &flight]( SharedBuffer message )
+                                                                  {
+                                                                      messages.push_back( message );
+                                                                      flight->publish( message );
+                                                                  } );
+                                 // 途中で取り消された結果は不完全なのでキャッシュしない
+                                 const auto start = Metrics::Clock::now();
+                                 bool completed;
+                                 std::string error;
+                                 {
+                                     Trace::Scope trace( "server", "sampling", requestId );
+                                     completed = Server::createParticleMessages( *volume, parameters, tfunc, assembler, flight->cancelled(), m_metrics, m_worker_pool, &error );
+                                 }
+                                 m_metrics.observeSince( Metrics::SamplingSeconds, start );
+                                 volume.reset();
+                                 m_volume_registry.releaseUnused(); // 使い終わったボリュームが容量を超えていれば解放する
+                                 if( completed )
+                                 {
+                                     m_result_cache.insert( parameters, std::move( messages ) );
+                                 }
+                                 else if( error.empty() )
+                                 {
+                                     m_metrics.increment( Metrics::CancelledSamplings );
+                                 }
+                                 else
+                                 {
+                                     SERVER_LOG( Error ) << "[Server] " << error << " (" << parameters.volume_id << ")";
+                                     m_metrics.increment( Metrics::FailedSamplings );
+                                 }
+                                 flight->finish( completed, error );
+                             } );
+    }
+    else if( received.type == ClientMessage::Chat )
+    {
+        if( received.has_chat_message )
+        {
+            // ルームに参加していなければ lobby に参加させ、送信者にも届くようにする
+            if( session->room.empty() ) subscribeChat( ws, DefaultRoom, session->control_encoding );
+            publishChat( session->room, received.chat_message );
+        }
+        else
+        {
+            SERVER_LOG( Warning ) << "chat_message missing or invalid type";
+        }
+    }
+    else if( received.type == ClientMessage::Hello )
+    {
+        // 対応していない符号化を求められた場合は JSON のままにする
+        // 応答は切り替え前の JSON で返し、クライアントはそれを受け取ってから切り替える
+        ControlEncoding::Encoding requested = ControlEncoding::Json;
+        if( !ControlEncoding::FromName( received.control_encoding, &requested ) )
+        {
+            SERVER_LOG( Warning ) << "unsupported control_encoding: " << received.control_encoding;
+        }
+        const ControlEncoding::Encoding previous = session->control_encoding;
+        session->control_encoding = ControlEncoding::Json;
+        sendControlMessage( ws, { { "type", "hello" }, { "control_encoding", ControlEncoding::Name( requested ) } } );
+        session->control_encoding = previous;
+        if( session->room.empty() ) session->control_encoding = requested;
+        else subscribeChat( ws, session->room, requested ); // 購読中のトピックも新しい符号化のものに移る
+    }
+    else if( received.type == ClientMessage::Join )
+    {
+        if( received.room.empty() || received.room.size() > MaxRoomNameLength || received.room.find( '/' ) != std::string::npos )
+        {
+            sendError( ws, "invalid room name" );
+            return;
+        }
+        subscribeChat( ws, received.room, session->control_encoding );
+        sendControlMessage( ws, { { "type", "join" }, { "room", received.room } } );
+    }
+    else
+    {
+        SERVER_LOG( Warning ) << "unknown message type: " << received.type_name;
     }
 }
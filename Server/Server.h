@@ -6,29 +6,121 @@
 #else
 #include <App.h>
 #endif
+#include "../Shared/ControlEncoding.h"
 #include "../Shared/json.hpp"
 
-#include <kvs/HydrogenVolumeData>
 #include <kvs/TransferFunction>
 #include <kvs/RGBColor>
 #include <kvs/CellByCellMetropolisSampling>
 
+#include <deque>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "CancellationToken.h"
+#include "ClientMessage.h"
+#include "Metrics.h"
+#include "ParallelCellByCellSampling.h"
+#include "ParticleChunkAssembler.h"
+#include "ResultCache.h"
+#include "SamplingParameters.h"
+#include "SamplingRequest.h"
+#include "SharedBuffer.h"
+#include "SingleFlight.h"
+#include "VolumeRegistry.h"
+#include "WorkerPool.h"
+
+// 送信キューに積まれたメッセージ
+struct QueuedMessage
+{
+    SharedBuffer message;
+    uWS::OpCode opCode;
+    std::uint32_t request_id; // 粒子メッセージであれば要求 ID (制御メッセージは 0)
+    Metrics::Clock::time_point enqueued_at;
+};
+
+// 処理中のサンプリング要求
+struct InFlightRequest
+{
+    CancellationToken token;       // この要求の取り消し (ソケットに触れてよいかの確認にも使う)
+    SingleFlight::Ticket ticket;   // 加わっている計算
+};
+
 struct ClientSession
 {
+    // 処理中のサンプリング要求 (要求 ID -> 要求)
+    // 新しい要求を受け付けると古い要求は取り消す。切断時にはすべて取り消す
+    // ワーカースレッドから戻ってきた処理は、取り消されていればソケットに触れない (参照はイベントループスレッド上のみ)
+    std::uint32_t next_request_id = 1;
+    std::unordered_map<std::uint32_t, InFlightRequest> in_flight;
+    SamplingParameters last_parameters; // 最後に受け付けた要求のパラメータ
+    bool has_last_parameters = false;
+
+    // 送信待ちのメッセージ (ソケットの未送信バイト数が閾値を下回ったら先頭から送る)
+    // バッファはキャッシュなどと共有しているので、ここではコピーしない
+    std::deque<QueuedMessage> send_queue;
+    std::size_t queued_bytes = 0;
+    std::size_t buffered_amount = 0; // 最後に観測した uWS の未送信バイト数 (計測用)
+
+    // 制御メッセージの符号化 (hello でネゴシエーションされるまでは JSON)
+    ControlEncoding::Encoding control_encoding = ControlEncoding::Json;
+
+    // 参加しているチャットのルーム (トピック "chat/<room>/<符号化>" を購読する)
+    // join するか最初にチャットを送るまでは空 (どのトピックも購読しない)
+    std::string room;
 };
 
 class Server
 {
 public:
-    Server( int port );
+    // volumeFiles: ファイルから読み込むボリューム (ID -> ファイル名)。"hydrogen" は常に使える
+    Server( int port, unsigned int numberOfThreads = 1, const std::map<std::string, std::string>& volumeFiles = {} );
 
 private:
-    uWS::App m_u_web_sockets;
     int m_port;
+    unsigned int m_number_of_threads;  // イベントループ(uWS::App)の数
+    Metrics m_metrics; // /metrics で公開する計測値
+    ResultCache m_result_cache; // シリアライズ済みのサンプリング結果
+    VolumeRegistry m_volume_registry; // 常駐させるボリューム
+    SingleFlight m_single_flight; // 同じパラメータで同時に来た要求を 1 回のサンプリングにまとめる
+    // サンプリング処理用 (イベントループは I/O のみ行う)
+    // 破棄時に残っているジョブを処理し終えるまで待つので、ジョブが使う上のメンバより後に宣言する (先に破棄される)
+    // (その時点でイベントループは終了しており、全ソケットの要求は取り消し済みなので、ジョブがループに defer することはない)
+    WorkerPool m_worker_pool;
+    std::vector<std::thread> m_event_loop_threads;
+
+    // チャットを全スレッドの App に publish するため、実行中のイベントループを登録しておく
+    struct EventLoop
+    {
+        uWS::Loop* loop;
+        uWS::App* app;
+    };
+    std::mutex m_event_loops_mutex;
+    std::vector<EventLoop> m_event_loops;
 
     void initialize();
+    void runEventLoop( unsigned int threadIndex );
+    static bool createParticleMessages( const kvs::StructuredVolumeObject& volume, const SamplingParameters& parameters, const kvs::TransferFunction& tfunc, ParticleChunkAssembler& assembler, const std::atomic<bool>* cancelled, Metrics& metrics, WorkerPool& pool, std::string* error );
+    void sendMessages( uWS::WebSocket<false, true, ClientSession>* ws, const SharedBufferList& messages, std::uint32_t requestId );
+    bool enqueue( uWS::WebSocket<false, true, ClientSession>* ws, SharedBuffer message, uWS::OpCode opCode, std::uint32_t requestId = 0 );
+    void cancelRequests( uWS::WebSocket<false, true, ClientSession>* ws );
+    void flush( uWS::WebSocket<false, true, ClientSession>* ws );
+    static std::string chatTopic( const std::string& room, ControlEncoding::Encoding encoding );
+    void subscribeChat( uWS::WebSocket<false, true, ClientSession>* ws, const std::string& room, ControlEncoding::Encoding encoding );
+    void publishChat( const std::string& room, const std::string& chat );
+    void sendControlMessage( uWS::WebSocket<false, true, ClientSession>* ws, std::initializer_list<std::pair<std::string_view, std::string_view>> entries );
+    void sendError( uWS::WebSocket<false, true, ClientSession>* ws, const std::string& message );
+    std::string renderMetrics() const;
 
     void onOpen( uWS::WebSocket<false, true, ClientSession>* ws );
+    void onDrain( uWS::WebSocket<false, true, ClientSession>* ws );
     void onClose( uWS::WebSocket<false, true, ClientSession>* ws, int /*code*/, std::string_view /*msg*/ );
     void onMessage( uWS::WebSocket<false, true, ClientSession>* ws, std::string_view message, uWS::OpCode );
 };
@@ -206,11 +206,39 @@ unix:!macx {
 }
 
 SOURCES += \
+    ClientMessage.cpp \
+    ParallelCellByCellSampling.cpp \
+    Logger.cpp \
+    Metrics.cpp \
+    ParticleChunkAssembler.cpp \
+    ResultCache.cpp \
+    SamplingRequest.cpp \
+    SingleFlight.cpp \
     Server.cpp \
+    VolumeRegistry.cpp \
+    WorkerPool.cpp \
     main.cpp
 
 HEADERS += \
-    Server.h
+    ../Shared/ControlEncoding.h \
+    ../Shared/CoordinateQuantization.h \
+    ../Shared/OctahedralNormal.h \
+    ../Shared/ParticleWireFormat.h \
+    ../Shared/Trace.h \
+    CancellationToken.h \
+    ClientMessage.h \
+    Logger.h \
+    Metrics.h \
+    ParallelCellByCellSampling.h \
+    ParticleChunkAssembler.h \
+    ResultCache.h \
+    SamplingParameters.h \
+    SamplingRequest.h \
+    Server.h \
+    SharedBuffer.h \
+    SingleFlight.h \
+    VolumeRegistry.h \
+    WorkerPool.h
 
 qnx: target.path = /tmp/$${TARGET}/bin
 else: unix:!android: target.path = /opt/$${TARGET}/bin
@@ -0,0 +1,15 @@
+#ifndef SHAREDBUFFER_H
+#define SHAREDBUFFER_H
+
+#include <memory>
+#include <vector>
+
+// 送信用のバイナリバッファ
+// 生成後は書き換えないので、キャッシュや複数のセッションから同時に参照してよい
+using SharedBuffer = std::shared_ptr<const std::vector<char>>;
+
+// 1 回の要求に対する応答 (送信順に並んだメッセージ)
+// 通常は 1 メッセージ、チャンク送信のときはチャンクごとのメッセージになる
+using SharedBufferList = std::vector<SharedBuffer>;
+
+#endif // SHAREDBUFFER_H
@@ -0,0 +1,102 @@
+#include "SingleFlight.h"
+
+#include <algorithm>
+
+SingleFlight::Flight::Flight( SingleFlight* owner, const SamplingParameters& parameters )
+    : m_owner( owner )
+    , m_parameters( parameters )
+    , m_token( MakeCancellationToken() )
+{
+}
+
+void SingleFlight::Flight::publish( SharedBuffer message )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_messages.push_back( message );
+    for( auto& listener : m_listeners ) listener.second.message( message );
+}
+
+void SingleFlight::Flight::finish( bool completed, const std::string& error )
+{
+    // 以降に同じパラメータで来た要求は、新しい計算 (またはキャッシュ) を使う
+    m_owner->remove( this );
+
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_finished = true;
+    m_completed = completed && !m_token->load();
+    m_error = completed ? std::string() : error;
+    for( auto& listener : m_listeners ) listener.second.finished( m_completed, m_error );
+    m_listeners.clear();
+}
+
+void SingleFlight::Flight::leave( std::uint64_t listenerId )
+{
+    bool abandoned = false;
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        auto found = std::find_if( m_listeners.begin(), m_listeners.end(), [listenerId]( const auto& listener ) { return listener.first == listenerId; } );
+        if( found == m_listeners.end() ) return;
+        m_listeners.erase( found );
+
+        // 誰も待っていない計算は止める
+        if( m_listeners.empty() && !m_finished )
+        {
+            m_token->store( true );
+            abandoned = true;
+        }
+    }
+
+    // 取り消した計算に後から加わらないように外す (ロックの順序を保つため、Flight のロックを放してから)
+    if( abandoned ) m_owner->remove( this );
+}
+
+SingleFlight::Ticket SingleFlight::join( const SamplingParameters& parameters, Listener listener )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    Ticket ticket;
+    ticket.listener_id = m_next_listener_id++;
+
+    auto found = m_flights.find( parameters );
+    if( found != m_flights.end() )
+    {
+        Flight& flight = *found->second;
+        std::lock_guard<std::mutex> flightLock( flight.m_mutex );
+
+        // 全員が抜けて取り消された計算 (まだ外されていないもの) には加わらない
+        if( !flight.m_token->load() )
+        {
+            for( const auto& message : flight.m_messages ) listener.message( message ); // 出来上がっている分を先に渡す
+            if( flight.m_finished ) listener.finished( flight.m_completed, flight.m_error );
+            else flight.m_listeners.emplace_back( ticket.listener_id, std::move( listener ) );
+
+            ticket.flight = found->second;
+            ++m_number_of_shared_joins;
+            return ticket;
+        }
+    }
+
+    ticket.flight = std::make_shared<Flight>( this, parameters );
+    ticket.flight->m_listeners.emplace_back( ticket.listener_id, std::move( listener ) );
+    ticket.leader = true;
+    m_flights[ parameters ] = ticket.flight;
+    return ticket;
+}
+
+void SingleFlight::remove( const Flight* flight )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    auto found = m_flights.find( flight->parameters() );
+    if( found != m_flights.end() && found->second.get() == flight ) m_flights.erase( found );
+}
+
+std::size_t SingleFlight::numberOfFlights() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_flights.size();
+}
+
+std::size_t SingleFlight::numberOfSharedJoins() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_number_of_shared_joins;
+}
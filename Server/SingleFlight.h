@@ -0,0 +1,88 @@
+#ifndef SINGLEFLIGHT_H
+#define SINGLEFLIGHT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "CancellationToken.h"
+#include "SamplingParameters.h"
+#include "SharedBuffer.h"
+
+// 同じパラメータで同時に来たサンプリング要求を 1 回の計算にまとめる
+//
+// 最初の要求 (leader) だけが計算を行い、計算中に来た同じパラメータの要求はその計算に加わる
+// 加わった時点までに出来上がっていたメッセージはその場で受け取るので、チャンク送信でも最初のチャンクから揃う
+// メッセージは全員で同じバッファを共有する (書き換えない)
+// 加わっている要求がすべて抜けると、計算は取り消される
+class SingleFlight
+{
+public:
+    // 計算の結果を受け取る側
+    // コールバックは Flight のロックを取得したまま呼ばれるので、軽い処理 (イベントループへの defer など) に留め、
+    // Flight や SingleFlight を呼び返してはいけない
+    struct Listener
+    {
+        std::function<void( SharedBuffer message )> message; // メッセージが出来るたびに、出来上がった順に呼ばれる
+        // 計算が終わったときに 1 回だけ呼ばれる (取り消し・失敗では false。失敗のときは error に理由が入る)
+        std::function<void( bool completed, const std::string& error )> finished;
+    };
+
+    // 1 つの計算
+    class Flight
+    {
+    public:
+        Flight( SingleFlight* owner, const SamplingParameters& parameters );
+
+        const SamplingParameters& parameters() const { return m_parameters; }
+        const std::atomic<bool>* cancelled() const { return m_token.get(); }
+
+        // 計算する側 (leader のジョブ) が呼ぶ
+        void publish( SharedBuffer message );
+        void finish( bool completed, const std::string& error = {} ); // 結果をキャッシュする場合は、後から来た要求が取りこぼさないよう finish の前に行う
+
+        // 要求を取り消すときに呼ぶ
+        void leave( std::uint64_t listenerId );
+
+    private:
+        friend class SingleFlight;
+
+        SingleFlight* m_owner;
+        const SamplingParameters m_parameters;
+        CancellationToken m_token;
+        std::mutex m_mutex;
+        SharedBufferList m_messages;
+        std::vector<std::pair<std::uint64_t, Listener>> m_listeners;
+        bool m_finished = false;
+        bool m_completed = false;
+        std::string m_error;
+    };
+
+    struct Ticket
+    {
+        std::shared_ptr<Flight> flight;
+        std::uint64_t listener_id = 0;
+        bool leader = false; // true であれば、呼び出し側が計算を始めて publish / finish すること
+    };
+
+    Ticket join( const SamplingParameters& parameters, Listener listener );
+
+    std::size_t numberOfFlights() const;
+    std::size_t numberOfSharedJoins() const; // 既存の計算に加わった回数
+
+private:
+    void remove( const Flight* flight );
+
+    mutable std::mutex m_mutex;
+    std::unordered_map<SamplingParameters, std::shared_ptr<Flight>> m_flights;
+    std::uint64_t m_next_listener_id = 1;
+    std::size_t m_number_of_shared_joins = 0;
+};
+
+#endif // SINGLEFLIGHT_H
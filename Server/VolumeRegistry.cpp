@@ -0,0 +1,168 @@
+#include "VolumeRegistry.h"
+
+#include <chrono>
+#include <exception>
+
+#include <kvs/HydrogenVolumeData>
+#include <kvs/StructuredVolumeImporter>
+
+#include "Logger.h"
+
+namespace
+{
+
+const std::string HydrogenVolumeID = "hydrogen";
+
+} // end of namespace
+
+VolumeRegistry::VolumeRegistry( std::size_t capacityInBytes )
+    : m_capacity( capacityInBytes )
+{
+}
+
+void VolumeRegistry::registerFile( const std::string& id, const std::string& filename )
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    m_files[id] = filename;
+}
+
+bool VolumeRegistry::contains( const std::string& id ) const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return IsGenerated( id ) || m_files.count( id ) > 0;
+}
+
+bool VolumeRegistry::IsGenerated( const std::string& id )
+{
+    return id == HydrogenVolumeID;
+}
+
+VolumeRegistry::Volume VolumeRegistry::acquire( const std::string& id, const kvs::Vec3ui& dims )
+{
+    std::string key = id;
+    std::string filename;
+    std::promise<Volume> promise;
+    std::shared_future<Volume> future;
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        if( IsGenerated( id ) )
+        {
+            // 生成するボリュームは解像度ごとに別物として扱う
+            key += "/" + std::to_string( dims[0] ) + "x" + std::to_string( dims[1] ) + "x" + std::to_string( dims[2] );
+        }
+        else
+        {
+            auto file = m_files.find( id );
+            if( file == m_files.end() ) return nullptr;
+            filename = file->second;
+            key = "file/" + id; // 生成するボリュームのキーと重ならないようにする
+        }
+
+        auto found = m_volumes.find( key );
+        if( found != m_volumes.end() )
+        {
+            found->second.last_used = ++m_clock;
+            future = found->second.volume;
+        }
+        else
+        {
+            m_volumes.emplace( key, Entry{ promise.get_future().share(), 0, ++m_clock } );
+        }
+    }
+
+    // 生成中であれば完了を待つ (他の acquire や contains を止めないよう、ロックの外で待つ)
+    if( future.valid() ) return future.get();
+
+    // 生成(読み込み)はロックの外で行い、他のボリュームの取得を妨げない
+    // 例外 (大きなボリュームでの bad_alloc など) は失敗として扱う。promise を満たさずに抜けると、
+    // 待っている acquire が future_error を投げてしまう
+    Volume volume;
+    try
+    {
+        volume = create( id, dims, filename );
+    }
+    catch( const std::exception& e )
+    {
+        SERVER_LOG( Error ) << "[VolumeRegistry] Failed to create " << key << ": " << e.what();
+        volume = nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        auto found = m_volumes.find( key );
+        if( !volume )
+        {
+            m_volumes.erase( found ); // 失敗したものは次回やり直す
+        }
+        else
+        {
+            found->second.size = volume->values().byteSize();
+            m_size += found->second.size;
+            this->evict();
+        }
+    }
+    promise.set_value( volume ); // 容量の計算に入れてから完了にする (生成中のものは evict の対象外)
+    return volume;
+}
+
+void VolumeRegistry::releaseUnused()
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    this->evict();
+}
+
+std::size_t VolumeRegistry::size() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_size;
+}
+
+std::size_t VolumeRegistry::numberOfVolumes() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_volumes.size();
+}
+
+void VolumeRegistry::evict()
+{
+    // 容量を超えている間、レジストリ以外から参照されていないものを古い順に解放する
+    // 最後に取得されたものは、容量より大きくても残す (大きなボリュームを要求ごとに読み直さないように)
+    while( m_size > m_capacity )
+    {
+        auto oldest = m_volumes.end();
+        auto newest = m_volumes.end();
+        for( auto it = m_volumes.begin(); it != m_volumes.end(); ++it )
+        {
+            if( newest == m_volumes.end() || it->second.last_used > newest->second.last_used ) newest = it;
+
+            const bool ready = it->second.volume.wait_for( std::chrono::seconds( 0 ) ) == std::future_status::ready;
+            if( !ready || it->second.volume.get().use_count() > 1 ) continue;
+            if( oldest == m_volumes.end() || it->second.last_used < oldest->second.last_used ) oldest = it;
+        }
+        if( oldest == m_volumes.end() || oldest == newest ) return;
+
+        m_size -= oldest->second.size;
+        m_volumes.erase( oldest );
+    }
+}
+
+VolumeRegistry::Volume VolumeRegistry::create( const std::string& id, const kvs::Vec3ui& dims, const std::string& filename )
+{
+    std::shared_ptr<kvs::StructuredVolumeObject> volume;
+    if( IsGenerated( id ) )
+    {
+        volume = std::make_shared<kvs::HydrogenVolumeData>( dims );
+    }
+    else
+    {
+        volume = std::make_shared<kvs::StructuredVolumeImporter>( filename );
+        if( volume->numberOfNodes() == 0 )
+        {
+            SERVER_LOG( Error ) << "[VolumeRegistry] Failed to read " << filename;
+            return nullptr;
+        }
+    }
+
+    // サンプリング中に値域を計算させないよう、共有する前に確定させておく
+    if( !volume->hasMinMaxValues() ) volume->updateMinMaxValues();
+    return volume;
+}
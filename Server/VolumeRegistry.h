@@ -0,0 +1,63 @@
+#ifndef VOLUMEREGISTRY_H
+#define VOLUMEREGISTRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <kvs/StructuredVolumeObject>
+#include <kvs/Vector3>
+
+// サーバが扱うボリュームを一度だけ生成(読み込み)し、常駐させて全セッションで共有する
+// 取得したボリュームは const で参照カウント付きのため、複数のサンプリングから同時に読んでよい
+//
+// ボリューム ID:
+//   "hydrogen"          : kvs::HydrogenVolumeData を指定解像度で生成する
+//   registerFile() した ID : ファイルから読み込む (解像度はファイルに従う)
+//
+// 常駐させるボリュームの合計バイト数は容量で制限し、超えた分は使われていないものから古い順 (LRU) に解放する
+// (使用中のボリュームは解放しないので、一時的に容量を超えることがある)
+class VolumeRegistry
+{
+public:
+    using Volume = std::shared_ptr<const kvs::StructuredVolumeObject>;
+
+    explicit VolumeRegistry( std::size_t capacityInBytes );
+    VolumeRegistry( const VolumeRegistry& ) = delete;
+    VolumeRegistry& operator=( const VolumeRegistry& ) = delete;
+
+    void registerFile( const std::string& id, const std::string& filename );
+    bool contains( const std::string& id ) const;
+    static bool IsGenerated( const std::string& id ); // acquire() の dims で生成するボリュームか (ファイルのボリュームは dims を使わない)
+
+    Volume acquire( const std::string& id, const kvs::Vec3ui& dims );
+    void releaseUnused(); // 容量を超えていれば、使われていないボリュームを解放する (使い終わったときに呼ぶ)
+
+    std::size_t capacity() const { return m_capacity; }
+    std::size_t size() const;
+    std::size_t numberOfVolumes() const;
+
+private:
+    struct Entry
+    {
+        std::shared_future<Volume> volume;
+        std::size_t size = 0;        // 値のバイト数 (生成中は 0)
+        std::uint64_t last_used = 0; // 最後に取得された順番
+    };
+
+    static Volume create( const std::string& id, const kvs::Vec3ui& dims, const std::string& filename );
+    void evict(); // m_mutex を取得した状態で呼ぶこと
+
+    const std::size_t m_capacity;
+    std::size_t m_size = 0;
+    std::uint64_t m_clock = 0;
+    std::map<std::string, std::string> m_files; // ID -> ファイル名
+    std::map<std::string, Entry> m_volumes;     // キー -> 生成済み(生成中)のボリューム
+    mutable std::mutex m_mutex;
+};
+
+#endif // VOLUMEREGISTRY_H
@@ -0,0 +1,62 @@
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+#include "../Shared/Trace.h"
+
+WorkerPool::WorkerPool( std::size_t numberOfThreads )
+{
+    numberOfThreads = std::max<std::size_t>( numberOfThreads, 1 ); // hardware_concurrency() は 0 を返すことがある
+    m_threads.reserve( numberOfThreads );
+    for( std::size_t i = 0; i < numberOfThreads; ++i )
+    {
+        m_threads.emplace_back( [this]() { this->run(); } );
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    for( auto& thread : m_threads )
+    {
+        if( thread.joinable() ) thread.join();
+    }
+}
+
+void WorkerPool::submit( Job job )
+{
+    {
+        std::lock_guard<std::mutex> lock( m_mutex );
+        m_jobs.push_back( std::move( job ) );
+    }
+    m_condition.notify_one();
+}
+
+std::size_t WorkerPool::numberOfPendingJobs() const
+{
+    std::lock_guard<std::mutex> lock( m_mutex );
+    return m_jobs.size();
+}
+
+void WorkerPool::run()
+{
+    Trace::SetThreadName( "worker" );
+    for( ;; )
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock( m_mutex );
+            m_condition.wait( lock, [this]() { return m_stopping || !m_jobs.empty(); } );
+            if( m_stopping && m_jobs.empty() ) return; // 残っているジョブを処理し終えてから終了する
+
+            job = std::move( m_jobs.front() );
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
@@ -0,0 +1,39 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// イベントループから重い処理(サンプリングなど)を切り離すためのスレッドプール
+// submit されたジョブはワーカースレッド上で FIFO 順に実行される
+class WorkerPool
+{
+public:
+    using Job = std::function<void()>;
+
+    explicit WorkerPool( std::size_t numberOfThreads = std::thread::hardware_concurrency() );
+    ~WorkerPool();
+
+    WorkerPool( const WorkerPool& ) = delete;
+    WorkerPool& operator=( const WorkerPool& ) = delete;
+
+    void submit( Job job );
+    std::size_t numberOfThreads() const { return m_threads.size(); }
+    std::size_t numberOfPendingJobs() const;
+
+private:
+    void run();
+
+    std::vector<std::thread> m_threads;
+    std::deque<Job> m_jobs;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stopping = false;
+};
+
+#endif // WORKERPOOL_H
@@ -1,6 +1,39 @@
 #include "Server.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#include "../Shared/Trace.h"
+#include "Logger.h"
+
 int main( int argc, char *argv[] )
 {
-    Server server( 60000 );
+    Trace::SetProcessName( "Server" );
+
+    // ログのレベルは環境変数 SERVER_LOG_LEVEL (debug / info / warning / error / off) で変えられる (省略時は info)
+    Logger::Level level = Logger::Info;
+    if( const char* name = std::getenv( "SERVER_LOG_LEVEL" ) )
+    {
+        if( Logger::LevelFromName( name, &level ) ) Logger::SetLevel( level );
+    }
+
+    // 1 番目の引数でイベントループのスレッド数を指定できる (省略時は 1)
+    // 以降の引数 "ID=ファイル名" で、ファイルから読み込むボリュームを登録する (要求の volume_id で指定する)
+    const int numberOfThreads = argc > 1 ? std::atoi( argv[1] ) : 1;
+    std::map<std::string, std::string> volumeFiles;
+    for( int i = 2; i < argc; ++i )
+    {
+        const std::string argument = argv[i];
+        const std::size_t separator = argument.find( '=' );
+        if( separator == 0 || separator == std::string::npos || separator + 1 == argument.size() )
+        {
+            SERVER_LOG( Error ) << "[Server] Invalid volume argument (expected ID=filename): " << argument;
+            Logger::Flush();
+            return 1;
+        }
+        volumeFiles[ argument.substr( 0, separator ) ] = argument.substr( separator + 1 );
+    }
+    Server server( 60000, static_cast<unsigned int>( std::max( numberOfThreads, 1 ) ), volumeFiles );
 }
@@ -0,0 +1,168 @@
+#ifndef CONTROLENCODING_H
+#define CONTROLENCODING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "json.hpp"
+
+// 制御メッセージ (要求・応答・チャット) の符号化 (サーバ・クライアント共通)
+//
+//   Json        : テキストフレームの JSON (既定。ネゴシエーションしないクライアントはこのまま)
+//   MessagePack : バイナリフレームの MessagePack
+//   Cbor        : バイナリフレームの CBOR
+//
+// 接続後にクライアントが {"type": "hello", "control_encoding": "msgpack"} を JSON で送り、
+// サーバは受け入れた符号化を {"type": "hello", "control_encoding": ...} (JSON) で返す
+// 以降はその符号化で制御メッセージをやり取りする (サーバは JSON のテキストフレームも常に受け付ける)
+// 粒子メッセージ (ParticleWireFormat) もバイナリフレームなので、受信側は先頭のマジックナンバーで区別する
+namespace ControlEncoding
+{
+
+enum Encoding : std::uint8_t
+{
+    Json = 0,
+    MessagePack = 1,
+    Cbor = 2
+};
+
+inline const char* Name( const Encoding encoding )
+{
+    return encoding == MessagePack ? "msgpack" : encoding == Cbor ? "cbor" : "json";
+}
+
+inline bool FromName( const std::string_view name, Encoding* encoding )
+{
+    if( name == "json" ) { *encoding = Json; return true; }
+    if( name == "msgpack" ) { *encoding = MessagePack; return true; }
+    if( name == "cbor" ) { *encoding = Cbor; return true; }
+    return false;
+}
+
+inline bool IsBinary( const Encoding encoding )
+{
+    return encoding != Json;
+}
+
+inline nlohmann::json::input_format_t InputFormat( const Encoding encoding )
+{
+    return encoding == MessagePack ? nlohmann::json::input_format_t::msgpack :
+           encoding == Cbor ? nlohmann::json::input_format_t::cbor :
+           nlohmann::json::input_format_t::json;
+}
+
+// DOM を符号化する (クライアントの要求など、構造を持つメッセージ用)
+inline std::vector<char> Encode( const nlohmann::json& message, const Encoding encoding )
+{
+    std::vector<char> out;
+    switch( encoding )
+    {
+    case MessagePack: nlohmann::json::to_msgpack( message, nlohmann::detail::output_adapter<char>( out ) ); break;
+    case Cbor: nlohmann::json::to_cbor( message, nlohmann::detail::output_adapter<char>( out ) ); break;
+    default:
+    {
+        const std::string text = message.dump( -1, ' ', false, nlohmann::json::error_handler_t::replace );
+        out.assign( text.begin(), text.end() );
+        break;
+    }
+    }
+    return out;
+}
+
+// 受信したメッセージを DOM に展開する。不正な場合は例外を投げずに discarded を返す
+inline nlohmann::json Decode( const char* data, const std::size_t size, const Encoding encoding )
+{
+    switch( encoding )
+    {
+    case MessagePack: return nlohmann::json::from_msgpack( data, data + size, true, false );
+    case Cbor: return nlohmann::json::from_cbor( data, data + size, true, false );
+    default: return nlohmann::json::parse( data, data + size, nullptr, false );
+    }
+}
+
+namespace detail
+{
+
+inline void PutBigEndian( std::vector<char>& out, const std::uint64_t value, const int bytes )
+{
+    for( int i = bytes - 1; i >= 0; --i ) out.push_back( static_cast<char>( ( value >> ( 8 * i ) ) & 0xFF ) );
+}
+
+// MessagePack / CBOR の長さ付きヘッダ (文字列・マップ)
+// tiny は 1 バイトに収まる長さの上限, base は 1 バイト形式の先頭バイト, extended は 1/2/4 バイト長の先頭バイト
+inline void PutLength( std::vector<char>& out, const std::size_t length, const std::size_t tiny, const std::uint8_t base, const std::uint8_t ( &extended )[3] )
+{
+    if( length < tiny ) { out.push_back( static_cast<char>( base | length ) ); }
+    else if( length <= 0xFF && extended[0] != 0 ) { out.push_back( static_cast<char>( extended[0] ) ); PutBigEndian( out, length, 1 ); }
+    else if( length <= 0xFFFF ) { out.push_back( static_cast<char>( extended[1] ) ); PutBigEndian( out, length, 2 ); }
+    else { out.push_back( static_cast<char>( extended[2] ) ); PutBigEndian( out, length, 4 ); }
+}
+
+inline void PutString( std::vector<char>& out, const std::string_view text, const Encoding encoding )
+{
+    if( encoding == MessagePack )
+    {
+        static const std::uint8_t extended[3] = { 0xd9, 0xda, 0xdb };
+        PutLength( out, text.size(), 32, 0xa0, extended );
+        out.insert( out.end(), text.begin(), text.end() );
+    }
+    else if( encoding == Cbor )
+    {
+        static const std::uint8_t extended[3] = { 0x78, 0x79, 0x7a };
+        PutLength( out, text.size(), 24, 0x60, extended );
+        out.insert( out.end(), text.begin(), text.end() );
+    }
+    else
+    {
+        // エスケープだけを json.hpp に任せる (不正な UTF-8 は置き換える)
+        const std::string quoted = nlohmann::json( std::string( text ) ).dump( -1, ' ', false, nlohmann::json::error_handler_t::replace );
+        out.insert( out.end(), quoted.begin(), quoted.end() );
+    }
+}
+
+} // end of namespace detail
+
+// 文字列だけからなる小さなマップを、DOM を作らずに直接符号化する (サーバの応答・チャット用)
+inline std::vector<char> EncodeStringMap( std::initializer_list<std::pair<std::string_view, std::string_view>> entries, const Encoding encoding )
+{
+    std::vector<char> out;
+    if( encoding == MessagePack )
+    {
+        static const std::uint8_t extended[3] = { 0, 0xde, 0xdf };
+        detail::PutLength( out, entries.size(), 16, 0x80, extended );
+    }
+    else if( encoding == Cbor )
+    {
+        static const std::uint8_t extended[3] = { 0xb8, 0xb9, 0xba };
+        detail::PutLength( out, entries.size(), 24, 0xa0, extended );
+    }
+    else
+    {
+        out.push_back( '{' );
+    }
+
+    bool first = true;
+    for( const auto& [key, value] : entries )
+    {
+        if( encoding == Json )
+        {
+            if( !first ) out.push_back( ',' );
+            first = false;
+        }
+        detail::PutString( out, key, encoding );
+        if( encoding == Json ) out.push_back( ':' );
+        detail::PutString( out, value, encoding );
+    }
+
+    if( encoding == Json ) out.push_back( '}' );
+    return out;
+}
+
+} // end of namespace ControlEncoding
+
+#endif // CONTROLENCODING_H
@@ -0,0 +1,152 @@
+#ifndef COORDINATEQUANTIZATION_H
+#define COORDINATEQUANTIZATION_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// 粒子座標をバウンディングボックス内の固定小数点値(bits ビット)に量子化する (サーバ・クライアント共通)
+// bits が 8 以下なら 1 成分 1 バイト、16 以下なら 2 バイト (リトルエンディアン) で格納する
+//
+// 座標は x, y, z が交互に並ぶので、成分ごとの係数を i % 3 で選ぶと自動ベクトル化されない
+// 16 頂点 (48 成分) を 1 タイルとし、タイル内の位置ごとに係数を展開しておくことで、
+// 各レーンの軸を固定した分岐の無いループにしている (-O3 / /Ox で SSE/AVX/NEON にベクトル化される)
+// 2 バイトの値はホストのエンディアンによらず、下位バイトから順に書く (リトルエンディアンのホストでは 16bit の書き込みにまとめられる)
+namespace CoordinateQuantization
+{
+
+constexpr int MinBits = 8;
+constexpr int MaxBits = 16;
+
+inline bool IsValidBits( const int bits )
+{
+    return MinBits <= bits && bits <= MaxBits;
+}
+
+inline std::size_t BytesPerComponent( const int bits )
+{
+    return bits <= 8 ? 1 : 2;
+}
+
+namespace detail
+{
+
+constexpr std::size_t TileVertices = 16;
+constexpr std::size_t TileComponents = TileVertices * 3;
+
+// タイル内の位置ごとの係数 (value = offset + q * scale, q = ( value - offset ) * scale)
+struct Tile
+{
+    float scale[TileComponents];
+    float offset[TileComponents];
+};
+
+inline void Store( std::uint8_t* out, const std::size_t i, const std::uint32_t q, std::integral_constant<int, 1> )
+{
+    out[i] = static_cast<std::uint8_t>( q );
+}
+
+inline void Store( std::uint8_t* out, const std::size_t i, const std::uint32_t q, std::integral_constant<int, 2> )
+{
+    out[ 2 * i ] = static_cast<std::uint8_t>( q );
+    out[ 2 * i + 1 ] = static_cast<std::uint8_t>( q >> 8 );
+}
+
+inline std::uint32_t Load( const std::uint8_t* in, const std::size_t i, std::integral_constant<int, 1> )
+{
+    return in[i];
+}
+
+inline std::uint32_t Load( const std::uint8_t* in, const std::size_t i, std::integral_constant<int, 2> )
+{
+    return static_cast<std::uint32_t>( in[ 2 * i ] ) | ( static_cast<std::uint32_t>( in[ 2 * i + 1 ] ) << 8 );
+}
+
+inline float Quantize( const float value, const float offset, const float scale, const float levels )
+{
+    float q = ( value - offset ) * scale + 0.5f;
+    q = q < 0.0f ? 0.0f : q;
+    return q > levels ? levels : q;
+}
+
+// Bytes: 1 成分のバイト数 (1 or 2)
+template <int Bytes>
+inline void Encode( const float* coords, const std::size_t numberOfVertices, const float min[3], const float max[3], const int bits, std::uint8_t* out )
+{
+    const float levels = static_cast<float>( ( 1u << bits ) - 1 );
+    Tile tile;
+    for( std::size_t k = 0; k < TileComponents; ++k )
+    {
+        const std::size_t c = k % 3;
+        const float extent = max[c] - min[c];
+        tile.scale[k] = extent > 0.0f ? levels / extent : 0.0f;
+        tile.offset[k] = min[c];
+    }
+
+    const std::size_t count = numberOfVertices * 3;
+    const std::size_t tiled = count - count % TileComponents;
+    for( std::size_t i = 0; i < tiled; i += TileComponents )
+    {
+        for( std::size_t k = 0; k < TileComponents; ++k )
+        {
+            const float q = Quantize( coords[ i + k ], tile.offset[k], tile.scale[k], levels );
+            Store( out, i + k, static_cast<std::uint32_t>( static_cast<std::int32_t>( q ) ), std::integral_constant<int, Bytes>() );
+        }
+    }
+    for( std::size_t i = tiled; i < count; ++i ) // 端数 (タイルの先頭からの位置が軸と一致する)
+    {
+        const std::size_t k = i - tiled;
+        const float q = Quantize( coords[i], tile.offset[k], tile.scale[k], levels );
+        Store( out, i, static_cast<std::uint32_t>( static_cast<std::int32_t>( q ) ), std::integral_constant<int, Bytes>() );
+    }
+}
+
+template <int Bytes>
+inline void Decode( const std::uint8_t* in, const std::size_t numberOfVertices, const float min[3], const float max[3], const int bits, float* coords )
+{
+    const float levels = static_cast<float>( ( 1u << bits ) - 1 );
+    Tile tile;
+    for( std::size_t k = 0; k < TileComponents; ++k )
+    {
+        const std::size_t c = k % 3;
+        tile.scale[k] = ( max[c] - min[c] ) / levels;
+        tile.offset[k] = min[c];
+    }
+
+    const std::size_t count = numberOfVertices * 3;
+    const std::size_t tiled = count - count % TileComponents;
+    for( std::size_t i = 0; i < tiled; i += TileComponents )
+    {
+        for( std::size_t k = 0; k < TileComponents; ++k )
+        {
+            const float q = static_cast<float>( static_cast<std::int32_t>( Load( in, i + k, std::integral_constant<int, Bytes>() ) ) );
+            coords[ i + k ] = tile.offset[k] + q * tile.scale[k];
+        }
+    }
+    for( std::size_t i = tiled; i < count; ++i )
+    {
+        const std::size_t k = i - tiled;
+        const float q = static_cast<float>( static_cast<std::int32_t>( Load( in, i, std::integral_constant<int, Bytes>() ) ) );
+        coords[i] = tile.offset[k] + q * tile.scale[k];
+    }
+}
+
+} // end of namespace detail
+
+// coords (float32 * 3N) -> out (BytesPerComponent( bits ) * 3N バイト。境界は揃っていなくてよい)
+inline void Encode( const float* coords, const std::size_t numberOfVertices, const float min[3], const float max[3], const int bits, void* out )
+{
+    if( bits <= 8 ) detail::Encode<1>( coords, numberOfVertices, min, max, bits, static_cast<std::uint8_t*>( out ) );
+    else detail::Encode<2>( coords, numberOfVertices, min, max, bits, static_cast<std::uint8_t*>( out ) );
+}
+
+inline void Decode( const void* in, const std::size_t numberOfVertices, const float min[3], const float max[3], const int bits, float* coords )
+{
+    if( bits <= 8 ) detail::Decode<1>( static_cast<const std::uint8_t*>( in ), numberOfVertices, min, max, bits, coords );
+    else detail::Decode<2>( static_cast<const std::uint8_t*>( in ), numberOfVertices, min, max, bits, coords );
+}
+
+} // end of namespace CoordinateQuantization
+
+#endif // COORDINATEQUANTIZATION_H
@@ -0,0 +1,183 @@
+#ifndef OCTAHEDRALNORMAL_H
+#define OCTAHEDRALNORMAL_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+// 法線を八面体写像で 2 成分に変換し、8bit または 16bit の整数で格納する (サーバ・クライアント共通)
+//
+//   Float32 : float32 * 3 (12 バイト / 粒子)
+//   Oct8    : uint8 * 2   ( 2 バイト / 粒子)
+//   Oct16   : uint16 * 2  ( 4 バイト / 粒子, リトルエンディアン)
+//
+// 入力の法線は正規化されていなくてよい (長さ 0 の法線は +z になる)
+// デコード結果は単位ベクトルになる
+//
+// 変換と量子化のループは分岐もトラップし得る条件付きの演算も持たない形にしてあり、GCC/Clang の -O3 で自動ベクトル化される
+// (エンコードは 64 個ずつのタイルで x, y, z を別々の配列に取り出してから計算する。デコードの正規化は std::sqrt を使わない)
+// Oct16 はホストのエンディアンによらずリトルエンディアンになるよう、バイト単位で読み書きする
+namespace OctahedralNormal
+{
+
+enum Encoding : std::uint8_t
+{
+    Float32 = 0,
+    Oct8 = 1,
+    Oct16 = 2
+};
+
+inline bool IsValidEncoding( const int encoding )
+{
+    return encoding == Float32 || encoding == Oct8 || encoding == Oct16;
+}
+
+inline std::size_t BytesPerNormal( const int encoding )
+{
+    return encoding == Oct8 ? 2 : encoding == Oct16 ? 4 : sizeof( float ) * 3;
+}
+
+namespace detail
+{
+
+// 1 タイルで処理する法線の数 (タイル内の作業配列はスタックに置く)
+constexpr std::size_t TileVertices = 64;
+
+inline float SignNotZero( const float x ) { return x >= 0.0f ? 1.0f : -1.0f; }
+
+inline float Quantize( const float value, const float levels )
+{
+    float q = ( value * 0.5f + 0.5f ) * levels + 0.5f;
+    q = q < 0.0f ? 0.0f : q;
+    return q > levels ? levels : q;
+}
+
+inline float Dequantize( const float q, const float levels )
+{
+    return q * ( 2.0f / levels ) - 1.0f;
+}
+
+// 1 / sqrt( x ) (x は [1/3, 1] の範囲で使う。初期値をビット演算で求め、ニュートン法を 2 回行う。相対誤差 5e-6 程度)
+// std::sqrt は errno を設定する経路を持つため、-fmath-errno (GCC の既定) ではループがベクトル化されない
+inline float ReciprocalSqrt( const float x )
+{
+    std::uint32_t i;
+    std::memcpy( &i, &x, sizeof( i ) );
+    i = 0x5f375a86u - ( i >> 1 );
+    float y;
+    std::memcpy( &y, &i, sizeof( y ) );
+    y = y * ( 1.5f - 0.5f * x * y * y );
+    y = y * ( 1.5f - 0.5f * x * y * y );
+    return y;
+}
+
+inline void Store( std::uint8_t* out, const std::size_t i, const std::int32_t qu, const std::int32_t qv, std::integral_constant<int, 1> )
+{
+    out[ 2 * i ] = static_cast<std::uint8_t>( qu );
+    out[ 2 * i + 1 ] = static_cast<std::uint8_t>( qv );
+}
+
+inline void Store( std::uint8_t* out, const std::size_t i, const std::int32_t qu, const std::int32_t qv, std::integral_constant<int, 2> )
+{
+    out[ 4 * i ] = static_cast<std::uint8_t>( qu );
+    out[ 4 * i + 1 ] = static_cast<std::uint8_t>( qu >> 8 );
+    out[ 4 * i + 2 ] = static_cast<std::uint8_t>( qv );
+    out[ 4 * i + 3 ] = static_cast<std::uint8_t>( qv >> 8 );
+}
+
+inline void Load( const std::uint8_t* in, const std::size_t i, std::int32_t* qu, std::int32_t* qv, std::integral_constant<int, 1> )
+{
+    *qu = in[ 2 * i ];
+    *qv = in[ 2 * i + 1 ];
+}
+
+inline void Load( const std::uint8_t* in, const std::size_t i, std::int32_t* qu, std::int32_t* qv, std::integral_constant<int, 2> )
+{
+    *qu = in[ 4 * i ] | ( in[ 4 * i + 1 ] << 8 );
+    *qv = in[ 4 * i + 2 ] | ( in[ 4 * i + 3 ] << 8 );
+}
+
+// Bytes: 1 成分のバイト数 (1: Oct8, 2: Oct16)
+// タイルごとに x, y, z を別々の配列に取り出し (SoA)、八面体写像と量子化を成分ごとの配列に対して行ってから格納する
+template <int Bytes>
+inline void Encode( const float* normals, const std::size_t numberOfVertices, std::uint8_t* out )
+{
+    const float levels = Bytes == 1 ? 255.0f : 65535.0f;
+    float x[TileVertices], y[TileVertices], z[TileVertices];
+    std::int32_t qu[TileVertices], qv[TileVertices];
+    for( std::size_t base = 0; base < numberOfVertices; base += TileVertices )
+    {
+        const std::size_t m = numberOfVertices - base < TileVertices ? numberOfVertices - base : TileVertices;
+        const float* in = normals + 3 * base;
+        for( std::size_t k = 0; k < m; ++k )
+        {
+            x[k] = in[ 3 * k ];
+            y[k] = in[ 3 * k + 1 ];
+            z[k] = in[ 3 * k + 2 ];
+        }
+
+        // 法線 (x, y, z) -> 八面体上の (u, v) ∈ [-1, 1]^2
+        // 除算を条件付きにするとトラップし得る命令とみなされてベクトル化されないので、分母に最小の正規化数を足す
+        // (長さ 0 の法線は px = py = 0 になる。l1 >= 1.2e-38 では l1 + FLT_MIN は 1 ulp 未満しか変わらない)
+        for( std::size_t k = 0; k < m; ++k )
+        {
+            const float l1 = std::fabs( x[k] ) + std::fabs( y[k] ) + std::fabs( z[k] );
+            const float inv = 1.0f / ( l1 + std::numeric_limits<float>::min() );
+            const float px = x[k] * inv;
+            const float py = y[k] * inv;
+            const bool lower = z[k] < 0.0f;
+            const float fx = ( 1.0f - std::fabs( py ) ) * SignNotZero( px );
+            const float fy = ( 1.0f - std::fabs( px ) ) * SignNotZero( py );
+            qu[k] = static_cast<std::int32_t>( Quantize( lower ? fx : px, levels ) );
+            qv[k] = static_cast<std::int32_t>( Quantize( lower ? fy : py, levels ) );
+        }
+
+        for( std::size_t k = 0; k < m; ++k ) Store( out, base + k, qu[k], qv[k], std::integral_constant<int, Bytes>() );
+    }
+}
+
+template <int Bytes>
+inline void Decode( const std::uint8_t* in, const std::size_t numberOfVertices, float* normals )
+{
+    const float levels = Bytes == 1 ? 255.0f : 65535.0f;
+    for( std::size_t i = 0; i < numberOfVertices; ++i )
+    {
+        std::int32_t qu, qv;
+        Load( in, i, &qu, &qv, std::integral_constant<int, Bytes>() );
+
+        // 八面体上の (u, v) -> 単位法線
+        float x = Dequantize( static_cast<float>( qu ), levels );
+        float y = Dequantize( static_cast<float>( qv ), levels );
+        const float z = 1.0f - std::fabs( x ) - std::fabs( y );
+        const float t = z < 0.0f ? -z : 0.0f;
+        x += x >= 0.0f ? -t : t;
+        y += y >= 0.0f ? -t : t;
+        const float inv = ReciprocalSqrt( x * x + y * y + z * z );
+        normals[ 3 * i ] = x * inv;
+        normals[ 3 * i + 1 ] = y * inv;
+        normals[ 3 * i + 2 ] = z * inv;
+    }
+}
+
+} // end of namespace detail
+
+// normals (float32 * 3N) -> out (BytesPerNormal( encoding ) * N バイト)
+inline void Encode( const float* normals, const std::size_t numberOfVertices, const int encoding, void* out )
+{
+    if( encoding == Oct8 ) detail::Encode<1>( normals, numberOfVertices, static_cast<std::uint8_t*>( out ) );
+    else if( encoding == Oct16 ) detail::Encode<2>( normals, numberOfVertices, static_cast<std::uint8_t*>( out ) );
+}
+
+// in (BytesPerNormal( encoding ) * N バイト) -> normals (float32 * 3N)
+inline void Decode( const void* in, const std::size_t numberOfVertices, const int encoding, float* normals )
+{
+    if( encoding == Oct8 ) detail::Decode<1>( static_cast<const std::uint8_t*>( in ), numberOfVertices, normals );
+    else if( encoding == Oct16 ) detail::Decode<2>( static_cast<const std::uint8_t*>( in ), numberOfVertices, normals );
+}
+
+} // end of namespace OctahedralNormal
+
+#endif // OCTAHEDRALNORMAL_H
@@ -0,0 +1,290 @@
+#ifndef PARTICLEWIREFORMAT_H
+#define PARTICLEWIREFORMAT_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "CoordinateQuantization.h"
+#include "OctahedralNormal.h"
+
+// サーバからクライアントへ送る粒子メッセージの形式 (サーバ・クライアント共通)
+//
+// [Header (HeaderSize バイト)][coords][colors][normals]
+//
+// ヘッダの各フィールドはリトルエンディアンの固定長整数・IEEE754 float32 で、ホストの語長や
+// エンディアンに依存しない。各セクションの位置と長さはヘッダに書かれており、先頭は 8 バイト境界に揃える
+// セクションの中身もリトルエンディアン (ビッグエンディアンのホストは ReadHeader で弾く)
+//
+//  offset  size  field
+//       0     4  magic ("KVSP")
+//       4     2  version
+//       6     2  header_size
+//       8     4  flags (ChunkFlag, LastChunkFlag)
+//      12     1  coord_bits (0: float32, 8-16: CoordinateQuantization)
+//      13     1  normal_encoding (OctahedralNormal::Encoding)
+//      14     2  reserved
+//      16     4  chunk_index (ChunkFlag のときのみ。0 がストリームの始まり)
+//      20     4  reserved
+//      24     8  number_of_vertices
+//      32    12  min_object_coord (float32 * 3)
+//      44    12  max_object_coord (float32 * 3)
+//      56    16  coords  section (offset, length : uint64)
+//      72    16  colors  section (offset, length : uint64)
+//      88    16  normals section (offset, length : uint64)
+//     104        (end of version 1 header)
+//
+// 粒子メッセージはキャッシュや同じパラメータの要求の間で共有するので、要求ごとの値 (要求 ID など) は持たない
+// (クライアントは chunk_index == 0 のチャンクで新しいストリームの始まりを知る)
+// 新しいバージョンでヘッダにフィールドを足す場合は末尾に追加し、header_size で読み飛ばせるようにする
+namespace ParticleWireFormat
+{
+
+constexpr std::uint32_t Magic = 0x5053564B; // "KVSP"
+constexpr std::uint16_t Version = 1;
+constexpr std::size_t HeaderSize = 104;
+constexpr std::size_t SectionAlignment = 8;
+
+enum Flags : std::uint32_t
+{
+    ChunkFlag = 1u << 0,     // 逐次送信されるストリームの 1 チャンク
+    LastChunkFlag = 1u << 1  // ストリームの最後のチャンク
+};
+
+struct Section
+{
+    std::uint64_t offset = 0;
+    std::uint64_t length = 0;
+};
+
+struct Header
+{
+    std::uint16_t version = Version;
+    std::uint16_t header_size = HeaderSize;
+    std::uint32_t flags = 0;
+    std::uint8_t coord_bits = 0;
+    std::uint8_t normal_encoding = OctahedralNormal::Float32;
+    std::uint32_t chunk_index = 0;
+    std::uint64_t number_of_vertices = 0;
+    float min_object_coord[3] = { 0.0f, 0.0f, 0.0f };
+    float max_object_coord[3] = { 0.0f, 0.0f, 0.0f };
+    Section coords;
+    Section colors;
+    Section normals;
+
+    bool isChunk() const { return ( flags & ChunkFlag ) != 0; }
+    bool isLastChunk() const { return ( flags & LastChunkFlag ) != 0; }
+};
+
+namespace detail
+{
+
+inline bool IsLittleEndianHost()
+{
+    const std::uint16_t value = 1;
+    std::uint8_t first;
+    std::memcpy( &first, &value, 1 );
+    return first == 1;
+}
+
+template <typename T>
+inline void Store( char* p, const T value )
+{
+    for( std::size_t i = 0; i < sizeof( T ); ++i ) p[i] = static_cast<char>( ( value >> ( 8 * i ) ) & 0xFF );
+}
+
+template <typename T>
+inline T Load( const char* p )
+{
+    T value = 0;
+    for( std::size_t i = 0; i < sizeof( T ); ++i ) value |= static_cast<T>( static_cast<std::uint8_t>( p[i] ) ) << ( 8 * i );
+    return value;
+}
+
+inline void StoreFloat( char* p, const float value )
+{
+    std::uint32_t bits;
+    std::memcpy( &bits, &value, sizeof( bits ) );
+    Store<std::uint32_t>( p, bits );
+}
+
+inline float LoadFloat( const char* p )
+{
+    const std::uint32_t bits = Load<std::uint32_t>( p );
+    float value;
+    std::memcpy( &value, &bits, sizeof( value ) );
+    return value;
+}
+
+inline std::uint64_t Align( const std::uint64_t offset )
+{
+    return ( offset + SectionAlignment - 1 ) / SectionAlignment * SectionAlignment;
+}
+
+} // end of namespace detail
+
+inline std::size_t BytesPerCoord( const int coordBits )
+{
+    return coordBits == 0 ? sizeof( float ) * 3 : CoordinateQuantization::BytesPerComponent( coordBits ) * 3;
+}
+
+// 粒子数と符号化からセクションの位置と長さを決める
+inline void ComputeLayout( Header* header )
+{
+    const std::uint64_t n = header->number_of_vertices;
+    header->header_size = HeaderSize;
+    header->coords.offset = detail::Align( HeaderSize );
+    header->coords.length = n * BytesPerCoord( header->coord_bits );
+    header->colors.offset = detail::Align( header->coords.offset + header->coords.length );
+    header->colors.length = n * 3;
+    header->normals.offset = detail::Align( header->colors.offset + header->colors.length );
+    header->normals.length = n * OctahedralNormal::BytesPerNormal( header->normal_encoding );
+}
+
+inline std::size_t MessageSize( const Header& header )
+{
+    return static_cast<std::size_t>( header.normals.offset + header.normals.length );
+}
+
+// out には HeaderSize バイト以上の領域が必要
+// 固定長の配列に組み立ててから写す (予約領域は 0。書き込み先の大きさをコンパイラが確かめられるようにする)
+inline void WriteHeader( const Header& header, char* destination )
+{
+    std::array<char, HeaderSize> bytes{};
+    char* out = bytes.data();
+    detail::Store<std::uint32_t>( out + 0, Magic );
+    detail::Store<std::uint16_t>( out + 4, header.version );
+    detail::Store<std::uint16_t>( out + 6, static_cast<std::uint16_t>( HeaderSize ) );
+    detail::Store<std::uint32_t>( out + 8, header.flags );
+    detail::Store<std::uint8_t>( out + 12, header.coord_bits );
+    detail::Store<std::uint8_t>( out + 13, header.normal_encoding );
+    detail::Store<std::uint32_t>( out + 16, header.chunk_index );
+    detail::Store<std::uint64_t>( out + 24, header.number_of_vertices );
+    for( int i = 0; i < 3; ++i )
+    {
+        detail::StoreFloat( out + 32 + 4 * i, header.min_object_coord[i] );
+        detail::StoreFloat( out + 44 + 4 * i, header.max_object_coord[i] );
+    }
+    const Section* sections[3] = { &header.coords, &header.colors, &header.normals };
+    for( int i = 0; i < 3; ++i )
+    {
+        detail::Store<std::uint64_t>( out + 56 + 16 * i, sections[i]->offset );
+        detail::Store<std::uint64_t>( out + 64 + 16 * i, sections[i]->length );
+    }
+    std::memcpy( destination, bytes.data(), bytes.size() );
+}
+
+// ヘッダを読み出して検証する (不正なメッセージや未対応のバージョンなら false)
+// 先頭のマジックナンバーだけを見て、粒子メッセージかどうかを判定する (制御メッセージとの区別用)
+inline bool IsParticleMessage( const char* data, const std::size_t size )
+{
+    return size >= 4 && detail::Load<std::uint32_t>( data ) == Magic;
+}
+
+inline bool ReadHeader( const char* data, const std::size_t size, Header* header )
+{
+    if( !detail::IsLittleEndianHost() ) return false;
+    if( size < HeaderSize ) return false;
+    if( detail::Load<std::uint32_t>( data + 0 ) != Magic ) return false;
+
+    header->version = detail::Load<std::uint16_t>( data + 4 );
+    header->header_size = detail::Load<std::uint16_t>( data + 6 );
+    if( header->version != Version || header->header_size < HeaderSize || header->header_size > size ) return false;
+
+    header->flags = detail::Load<std::uint32_t>( data + 8 );
+    header->coord_bits = detail::Load<std::uint8_t>( data + 12 );
+    header->normal_encoding = detail::Load<std::uint8_t>( data + 13 );
+    header->chunk_index = detail::Load<std::uint32_t>( data + 16 );
+    header->number_of_vertices = detail::Load<std::uint64_t>( data + 24 );
+    for( int i = 0; i < 3; ++i )
+    {
+        header->min_object_coord[i] = detail::LoadFloat( data + 32 + 4 * i );
+        header->max_object_coord[i] = detail::LoadFloat( data + 44 + 4 * i );
+    }
+    Section* sections[3] = { &header->coords, &header->colors, &header->normals };
+    for( int i = 0; i < 3; ++i )
+    {
+        sections[i]->offset = detail::Load<std::uint64_t>( data + 56 + 16 * i );
+        sections[i]->length = detail::Load<std::uint64_t>( data + 64 + 16 * i );
+    }
+
+    if( header->coord_bits != 0 && !CoordinateQuantization::IsValidBits( header->coord_bits ) ) return false;
+    if( !OctahedralNormal::IsValidEncoding( header->normal_encoding ) ) return false;
+
+    // 粒子数が大きすぎる場合の桁あふれを防ぐ (1 粒子あたり 3 バイト以上あるので size / 3 が上限)
+    const std::uint64_t n = header->number_of_vertices;
+    if( n > size / 3 ) return false;
+    if( header->coords.length != n * BytesPerCoord( header->coord_bits ) ) return false;
+    if( header->colors.length != n * 3 ) return false;
+    if( header->normals.length != n * OctahedralNormal::BytesPerNormal( header->normal_encoding ) ) return false;
+    for( const Section* section : sections )
+    {
+        if( section->offset < header->header_size || section->offset % SectionAlignment != 0 ) return false;
+        if( section->offset > size || section->length > size - section->offset ) return false;
+    }
+    return true;
+}
+
+// ヘッダを書き込んだメッセージ領域を確保する (各セクションは WriteParticles で書き込む)
+inline std::vector<char> Allocate( Header header )
+{
+    ComputeLayout( &header );
+    std::vector<char> buffer( MessageSize( header ) );
+    WriteHeader( header, buffer.data() );
+    return buffer;
+}
+
+// first 番目の粒子から count 個分を、ヘッダの符号化に従って各セクションへ書き込む
+inline void WriteParticles(
+    const Header& header,
+    char* message,
+    const std::size_t first,
+    const std::size_t count,
+    const float* coords,
+    const std::uint8_t* colors,
+    const float* normals )
+{
+    if( count == 0 ) return;
+
+    char* c = message + header.coords.offset + first * BytesPerCoord( header.coord_bits );
+    if( header.coord_bits == 0 ) std::memcpy( c, coords, sizeof( float ) * 3 * count );
+    else CoordinateQuantization::Encode( coords, count, header.min_object_coord, header.max_object_coord, header.coord_bits, c );
+
+    std::memcpy( message + header.colors.offset + first * 3, colors, 3 * count );
+
+    char* n = message + header.normals.offset + first * OctahedralNormal::BytesPerNormal( header.normal_encoding );
+    if( header.normal_encoding == OctahedralNormal::Float32 ) std::memcpy( n, normals, sizeof( float ) * 3 * count );
+    else OctahedralNormal::Encode( normals, count, header.normal_encoding, n );
+}
+
+// 各セクションを float32 * 3N / uint8 * 3N / float32 * 3N に展開する
+inline void ReadParticles( const Header& header, const char* message, float* coords, std::uint8_t* colors, float* normals )
+{
+    const std::size_t count = static_cast<std::size_t>( header.number_of_vertices );
+    if( count == 0 ) return;
+
+    const char* c = message + header.coords.offset;
+    if( header.coord_bits == 0 ) std::memcpy( coords, c, sizeof( float ) * 3 * count );
+    else CoordinateQuantization::Decode( c, count, header.min_object_coord, header.max_object_coord, header.coord_bits, coords );
+
+    std::memcpy( colors, message + header.colors.offset, 3 * count );
+
+    const char* n = message + header.normals.offset;
+    if( header.normal_encoding == OctahedralNormal::Float32 ) std::memcpy( normals, n, sizeof( float ) * 3 * count );
+    else OctahedralNormal::Decode( n, count, header.normal_encoding, normals );
+}
+
+// チャンク番号は送信直前に決まるので、書き出し済みのメッセージのヘッダを書き換える
+inline void SetChunkIndex( std::vector<char>& message, const std::uint32_t index, const bool last )
+{
+    std::uint32_t flags = detail::Load<std::uint32_t>( message.data() + 8 );
+    flags = last ? ( flags | LastChunkFlag ) : ( flags & ~LastChunkFlag );
+    detail::Store<std::uint32_t>( message.data() + 8, flags );
+    detail::Store<std::uint32_t>( message.data() + 16, index );
+}
+
+} // end of namespace ParticleWireFormat
+
+#endif // PARTICLEWIREFORMAT_H
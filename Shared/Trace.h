@@ -0,0 +1,290 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 処理の区間 (スパン) を記録し、Chrome のトレース形式 (chrome://tracing, Perfetto) の JSON で出力する (サーバ・クライアント共通)
+//
+//   {
+//       Trace::Scope scope( "server", "sampling", requestId ); // 生存期間が 1 つのスパンになる
+//       ...
+//   }
+//   const std::string json = Trace::Dump();
+//
+// スパンはスレッドごとのリングバッファ (RingSize 件) に書き込み、古いものから上書きする
+// 書き込むのはそのスレッドだけなので、記録にロックは使わない。Dump() は各スロットの
+// シーケンス番号で書き込み途中のスパンを読み飛ばす (seqlock)
+// 終了したスレッドのバッファは記録を残したまま次に生成されたスレッドが引き継ぐ
+// (スレッドの生成・終了を繰り返しても、バッファが増え続けないようにする)
+//
+// name と category は文字列リテラルなど、プロセスの終了まで有効な文字列を渡すこと
+namespace Trace
+{
+
+constexpr std::size_t RingSize = 8192; // スレッドあたりのスパン数
+
+namespace detail
+{
+
+using Clock = std::chrono::steady_clock;
+
+struct Slot
+{
+    std::atomic<std::uint64_t> sequence{ 0 }; // 奇数は書き込み中
+    std::atomic<const char*> category{ nullptr };
+    std::atomic<const char*> name{ nullptr };
+    std::atomic<std::int64_t> start{ 0 };     // ナノ秒 (Registry::origin から)
+    std::atomic<std::int64_t> duration{ 0 };  // ナノ秒
+    std::atomic<std::uint64_t> id{ 0 };       // 要求 ID など (0 は無し)
+};
+
+struct ThreadBuffer
+{
+    int tid = 0;
+    std::string name;                      // Registry::mutex で保護する
+    std::atomic<std::uint64_t> next{ 0 };  // 次に書き込む位置 (単調増加)
+    Slot slots[RingSize];
+};
+
+struct Registry
+{
+    std::atomic<bool> enabled{ true };
+    const Clock::time_point origin = Clock::now();
+    std::mutex mutex;
+    std::string process_name;
+    std::deque<std::unique_ptr<ThreadBuffer>> buffers;
+    std::vector<ThreadBuffer*> unused; // 終了したスレッドから返却されたもの
+};
+
+// 終了処理の途中で他のスレッドが記録しても壊れないよう、破棄しない
+inline Registry& GetRegistry()
+{
+    static Registry* registry = new Registry();
+    return *registry;
+}
+
+inline ThreadBuffer& LocalBuffer()
+{
+    struct Handle
+    {
+        ThreadBuffer* buffer;
+
+        Handle()
+        {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock( registry.mutex );
+            if( registry.unused.empty() )
+            {
+                registry.buffers.push_back( std::make_unique<ThreadBuffer>() );
+                buffer = registry.buffers.back().get();
+                buffer->tid = static_cast<int>( registry.buffers.size() );
+            }
+            else
+            {
+                buffer = registry.unused.back();
+                registry.unused.pop_back();
+            }
+            buffer->name.clear();
+        }
+
+        ~Handle()
+        {
+            Registry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock( registry.mutex );
+            registry.unused.push_back( buffer );
+        }
+    };
+
+    thread_local Handle handle;
+    return *handle.buffer;
+}
+
+inline void AppendEscaped( std::string& out, const char* text )
+{
+    for( const char* p = text; *p; ++p )
+    {
+        const unsigned char c = static_cast<unsigned char>( *p );
+        if( c == '"' || c == '\\' ) { out += '\\'; out += static_cast<char>( c ); }
+        else if( c < 0x20 ) { char escaped[8]; std::snprintf( escaped, sizeof( escaped ), "\\u%04x", c ); out += escaped; }
+        else out += static_cast<char>( c );
+    }
+}
+
+} // end of namespace detail
+
+inline void SetEnabled( const bool enabled )
+{
+    detail::GetRegistry().enabled.store( enabled, std::memory_order_relaxed );
+}
+
+inline bool IsEnabled()
+{
+    return detail::GetRegistry().enabled.load( std::memory_order_relaxed );
+}
+
+// トレースに表示するプロセス名 (Dump() の出力に含める)
+inline void SetProcessName( const std::string& name )
+{
+    detail::Registry& registry = detail::GetRegistry();
+    std::lock_guard<std::mutex> lock( registry.mutex );
+    registry.process_name = name;
+}
+
+// 呼び出し元スレッドの名前 (スレッドが終了すると、バッファを引き継いだスレッドが付け直す)
+inline void SetThreadName( const std::string& name )
+{
+    detail::ThreadBuffer& buffer = detail::LocalBuffer();
+    std::lock_guard<std::mutex> lock( detail::GetRegistry().mutex );
+    buffer.name = name;
+}
+
+// プロセス内で共通の時刻 (ナノ秒)
+inline std::int64_t Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>( detail::Clock::now() - detail::GetRegistry().origin ).count();
+}
+
+inline void Record( const char* category, const char* name, const std::int64_t start, const std::int64_t duration, const std::uint64_t id = 0 )
+{
+    detail::ThreadBuffer& buffer = detail::LocalBuffer();
+    const std::uint64_t index = buffer.next.load( std::memory_order_relaxed );
+    detail::Slot& slot = buffer.slots[ index % RingSize ];
+
+    const std::uint64_t sequence = slot.sequence.load( std::memory_order_relaxed );
+    slot.sequence.store( sequence + 1, std::memory_order_relaxed );
+    std::atomic_thread_fence( std::memory_order_release );
+    slot.category.store( category, std::memory_order_relaxed );
+    slot.name.store( name, std::memory_order_relaxed );
+    slot.start.store( start, std::memory_order_relaxed );
+    slot.duration.store( duration, std::memory_order_relaxed );
+    slot.id.store( id, std::memory_order_relaxed );
+    slot.sequence.store( sequence + 2, std::memory_order_release );
+    buffer.next.store( index + 1, std::memory_order_release );
+}
+
+// 生存期間を 1 つのスパンとして記録する (無効のときは時刻も取らない)
+class Scope
+{
+public:
+    Scope( const char* category, const char* name, const std::uint64_t id = 0 )
+        : m_category( category )
+        , m_name( name )
+        , m_id( id )
+        , m_start( IsEnabled() ? Now() : -1 )
+    {
+    }
+
+    ~Scope()
+    {
+        if( m_start >= 0 ) Record( m_category, m_name, m_start, Now() - m_start, m_id );
+    }
+
+    Scope( const Scope& ) = delete;
+    Scope& operator=( const Scope& ) = delete;
+
+    void setId( const std::uint64_t id ) { m_id = id; }
+
+private:
+    const char* m_category;
+    const char* m_name;
+    std::uint64_t m_id;
+    std::int64_t m_start;
+};
+
+// 全スレッドのリングバッファに残っているスパンを Chrome のトレース形式で出力する
+// バッファの一覧と名前だけをロック中に写し、スロットの読み出しと整形はロックの外で行う
+// (整形の間、新しいスレッドの LocalBuffer() を待たせない。バッファは破棄しないので、ロックの外で読んでよい)
+inline std::string Dump()
+{
+    struct Target
+    {
+        const detail::ThreadBuffer* buffer;
+        std::string name;
+    };
+    detail::Registry& registry = detail::GetRegistry();
+    std::string processName;
+    std::vector<Target> targets;
+    {
+        std::lock_guard<std::mutex> lock( registry.mutex );
+        processName = registry.process_name;
+        targets.reserve( registry.buffers.size() );
+        for( const auto& buffer : registry.buffers ) targets.push_back( { buffer.get(), buffer->name } );
+    }
+
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&out, &first]()
+    {
+        if( !first ) out += ",\n";
+        first = false;
+    };
+
+    if( !processName.empty() )
+    {
+        separator();
+        out += "{\"ph\":\"M\",\"pid\":1,\"tid\":0,\"name\":\"process_name\",\"args\":{\"name\":\"";
+        detail::AppendEscaped( out, processName.c_str() );
+        out += "\"}}";
+    }
+
+    char line[160];
+    for( const Target& target : targets )
+    {
+        const detail::ThreadBuffer* buffer = target.buffer;
+        if( !target.name.empty() )
+        {
+            separator();
+            std::snprintf( line, sizeof( line ), "{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"", buffer->tid );
+            out += line;
+            detail::AppendEscaped( out, target.name.c_str() );
+            out += "\"}}";
+        }
+
+        const std::uint64_t next = buffer->next.load( std::memory_order_acquire );
+        const std::uint64_t begin = next > RingSize ? next - RingSize : 0;
+        for( std::uint64_t index = begin; index < next; ++index )
+        {
+            const detail::Slot& slot = buffer->slots[ index % RingSize ];
+            const std::uint64_t before = slot.sequence.load( std::memory_order_acquire );
+            if( before % 2 != 0 ) continue; // 書き込み中
+            const char* category = slot.category.load( std::memory_order_relaxed );
+            const char* name = slot.name.load( std::memory_order_relaxed );
+            const std::int64_t start = slot.start.load( std::memory_order_relaxed );
+            const std::int64_t duration = slot.duration.load( std::memory_order_relaxed );
+            const std::uint64_t id = slot.id.load( std::memory_order_relaxed );
+            std::atomic_thread_fence( std::memory_order_acquire );
+            if( slot.sequence.load( std::memory_order_relaxed ) != before || name == nullptr ) continue; // 読んでいる間に上書きされた
+
+            separator();
+            out += "{\"ph\":\"X\",\"cat\":\"";
+            detail::AppendEscaped( out, category ? category : "" );
+            out += "\",\"name\":\"";
+            detail::AppendEscaped( out, name );
+            std::snprintf( line, sizeof( line ), "\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                           buffer->tid, start / 1000.0, duration / 1000.0 );
+            out += line;
+            if( id != 0 )
+            {
+                std::snprintf( line, sizeof( line ), ",\"args\":{\"id\":%llu}", static_cast<unsigned long long>( id ) );
+                out += line;
+            }
+            out += "}";
+        }
+    }
+
+    out += "]}\n";
+    return out;
+}
+
+} // end of namespace Trace
+
+#endif // TRACE_H